@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
 #include "sfs_api.h"
 #include "sfs_block.h"
 #include "sfs_inode.h"
@@ -17,6 +18,10 @@ uint32_t opened_files[MAX_OPEN_FILES];
 char *opened_files_names[MAX_OPEN_FILES];
 int file_offset[MAX_OPEN_FILES];
 
+// Guards the open file table and the directory table. Taken before any
+// i-node lock, and never held while waiting for one in the data paths
+pthread_mutex_t open_files_lock;
+
 
 // Initialization helper functions
 void init_superblock(){
@@ -24,10 +29,20 @@ void init_superblock(){
     superblock->magic = MAGIC_NUMBER;
     superblock->block_size = BLOCK_SIZE;
     superblock->file_system_size = NUM_BLOCKS;
-    superblock->inode_table_length = 1;
+    superblock->inode_table_length = 0;
     superblock->root_dir_inode = 0;
+    superblock->free_block_count = NUM_BLOCKS;
+    superblock->free_inode_count = 0;
+    superblock->free_inode_hint = 0;
+    superblock->inode_table_initialized = 0;
+
+    for(int i = 0; i < NUM_GROUPS; i++){
+        superblock->groups[i].free_block_count = get_group_end(i) - get_group_start(i);
+        superblock->groups[i].first_free_hint = get_group_start(i);
+    }
+    init_extent_root(&superblock->inode_table_map);
 
-    _write_block(0, (block_t*)superblock);
+    _write_meta_block(0, (block_t*)superblock);
     //write_blocks(0, 1, (void *) superblock);
 }
 
@@ -40,16 +55,15 @@ void init_root_node(){
     block_t *empty_block = calloc(1, sizeof(block_t));
     _write_block(dir_block, empty_block);*/
 
+    memset(&root_node, 0, sizeof(inode_t));
     root_node.mode = 0;
     root_node.link_count = 1;
     root_node.size = 0;
-    root_node.direct[0] = -1; //dir_block;
-    for(int i = 1; i < INODE_DIRECT_ACCESS; i++){
-        root_node.direct[i] = -1;
-    }
-    root_node.indirect = -1;
+    root_node.flags = INODE_INLINE;
+    init_extent_root(&root_node.map);
 
-    write_inode(&root_node, 0);
+    get_superblock()->root_dir_inode = alloc_inode();
+    write_inode(&root_node, get_superblock()->root_dir_inode);
 }
 
 void init_free_list(){
@@ -57,10 +71,15 @@ void init_free_list(){
         set_block_status(i, 0);
     }
     set_block_status(0, 1);
-    set_block_status(1, 1);
     for(int i = 0; i < NUM_FREE_BLOCKS; i++){
         set_block_status(NUM_BLOCKS - i - 1, 1);
     }
+
+    // Nothing is shared on a fresh disk
+    for(int i = 0; i < NUM_SHARE_BLOCKS; i++){
+        set_block_status(get_share_table_start() + i, 1);
+        new_meta_block(get_share_table_start() + i);
+    }
 }
 
 
@@ -68,6 +87,7 @@ void init_free_list(){
 // API functions
 void mksfs(int fresh)
 {
+    init_recursive_lock(&open_files_lock);
     init_block_cache();
     init_inode_cache();
 
@@ -91,7 +111,14 @@ void mksfs(int fresh)
             exit(1);
         }
 
-        _read_block(0, (void *) get_superblock());
+        _read_meta_block(0, (void *) get_superblock());
+        if(get_superblock()->magic != MAGIC_NUMBER){
+            printf("Error: Disk file has an unsupported format - Aborting %s\n\n", disk_name);
+            exit(1);
+        }
+
+        load_free_bitmap();
+        load_inode_bitmap();
     }
 
     read_dir_table();
@@ -100,39 +127,86 @@ void mksfs(int fresh)
     for(int i = 0; i < MAX_OPEN_FILES; i++){
         opened_files[i] = -1;
         file_offset[i] = -1;
+
+        free(opened_files_names[i]);
+        opened_files_names[i] = NULL;
+    }
+}
+
+// Open file slot of a descriptor, copied out so that no i-node is locked
+// with the table held
+static uint32_t get_open_file(int fd){
+    pthread_mutex_lock(&open_files_lock);
+    uint32_t inode_id = opened_files[fd];
+    pthread_mutex_unlock(&open_files_lock);
+
+    return inode_id;
+}
+
+// Reads the i-node of an open file, with its lock held. Fails when the
+// file was removed while the caller waited for the lock
+static int get_open_inode(uint32_t inode_id, inode_t* inode, int exclusive){
+    lock_inode(inode_id, exclusive);
+    get_inode(inode_id, inode);
+
+    if(inode->link_count <= 0){
+        unlock_inode(inode_id);
+        return -1;
     }
+
+    return 0;
 }
 
 
 uint32_t file_iter_id = 0;
 
 int sfs_getnextfilename(char* name){
+    pthread_mutex_lock(&open_files_lock);
     dir_entry_t *dir_entry = get_dir_table_entry(file_iter_id++);
 
     if(dir_entry == NULL){
+        pthread_mutex_unlock(&open_files_lock);
         return 0;
     }
 
     strcpy(name, dir_entry->filename);
+    pthread_mutex_unlock(&open_files_lock);
 
     return strlen(name);
 }
 
-int sfs_getfilesize(const char* name){
-    for(int i = 0; i < get_dir_table_size(); i++){
-        if(get_dir_table_entry(i) == NULL){
-            continue;
-        }
+int sfs_getfreeblocks(){
+    uint32_t unavailable = get_reserved_block_count() + EXTENT_RESERVE_BLOCKS;
+    uint32_t free_count = get_free_block_count();
+    if(free_count < unavailable){
+        return 0;
+    }
 
-        if(strcmp(name, get_dir_table_entry(i)->filename) == 0){
-            inode_t inode;
-            get_inode(get_dir_table_entry(i)->inode, &inode);
+    return free_count - unavailable;
+}
 
-            return inode.size;
-        }
+int sfs_getfreeinodes(){
+    return get_free_inode_count();
+}
+
+int sfs_getfilesize(const char* name){
+    pthread_mutex_lock(&open_files_lock);
+
+    int i = find_dir_table_entry(name);
+    if(i == -1){
+        pthread_mutex_unlock(&open_files_lock);
+        return -1;
     }
 
-    return -1;
+    uint32_t inode_id = get_dir_table_entry(i)->inode;
+
+    inode_t inode;
+    lock_inode(inode_id, 0);
+    get_inode(inode_id, &inode);
+    unlock_inode(inode_id);
+
+    pthread_mutex_unlock(&open_files_lock);
+    return inode.size;
 }
 
 
@@ -145,59 +219,71 @@ int sfs_fopen(char* name){
     if(strlen(name) > MAXFILENAME){
         return -1;
     }
+
+    pthread_mutex_lock(&open_files_lock);
     
     for(int i = 0; i < MAX_OPEN_FILES; i++){
         if(opened_files[i] == -1){
             free = i;
         }else if(strcmp(opened_files_names[i], name) == 0){
+                pthread_mutex_unlock(&open_files_lock);
                 return i;
         }
     }
 
     if(free == -1){
         printf("Error: Could not open file - No free file descriptors\n\n");
+        pthread_mutex_unlock(&open_files_lock);
         return -1;
     }
 
     // check if file exists
-    for(int i = 0; i < get_dir_table_size(); i++){
-        if(strcmp(name, get_dir_table_entry(i)->filename) == 0){
-            //opened_files_names[free] = name;
-            opened_files[free] = get_dir_table_entry(i)->inode;
-            opened_files_names[free] = name;
-
-            inode_t inode;
-            get_inode(opened_files[free], &inode);
-            file_offset[free] = inode.size;
-
-            return free;
-        }
+    int existing = find_dir_table_entry(name);
+    if(existing != -1){
+        opened_files[free] = get_dir_table_entry(existing)->inode;
+        opened_files_names[free] = strdup(name);
+
+        inode_t inode;
+        lock_inode(opened_files[free], 0);
+        get_inode(opened_files[free], &inode);
+        unlock_inode(opened_files[free]);
+        file_offset[free] = inode.size;
+
+        pthread_mutex_unlock(&open_files_lock);
+        return free;
     }
 
     // create new file
-    uint32_t inode_id = get_next_free_inode();
+    uint32_t inode_id = alloc_inode();
+    if(inode_id == -1){
+        pthread_mutex_unlock(&open_files_lock);
+        return -1;
+    }
+
+    // Unused bytes go to disk too
     inode_t inode;
+    memset(&inode, 0, sizeof(inode_t));
     inode.mode = 0;
     inode.link_count = 1;
     inode.size = 0;
-    for(int i = 0; i < INODE_DIRECT_ACCESS; i++){
-        inode.direct[i] = -1;
-    }
-    inode.indirect = -1;
+    inode.flags = INODE_INLINE;
+    init_extent_root(&inode.map);
 
     write_inode(&inode, inode_id);
 
     dir_entry_t entry;
+    memset(&entry, 0, sizeof(dir_entry_t));
     entry.valid = 1;
     entry.inode = inode_id;
     strcpy(entry.filename, name);
 
     write_to_dir_table(get_free_dir_table_entry(), &entry);
 
-    opened_files_names[free] = name;
+    opened_files_names[free] = strdup(name);
     opened_files[free] = inode_id;
     file_offset[free] = 0;
 
+    pthread_mutex_unlock(&open_files_lock);
     return free;
 }
 
@@ -207,54 +293,117 @@ int sfs_fclose(int fd){
         exit(1);
     }
 
+    pthread_mutex_lock(&open_files_lock);
+
     if(opened_files[fd] == -1){
+        pthread_mutex_unlock(&open_files_lock);
         return -1;
     }
 
+    uint32_t inode_id = opened_files[fd];
     opened_files[fd] = -1;
     file_offset[fd] = -1;
 
+    free(opened_files_names[fd]);
+    opened_files_names[fd] = NULL;
+
+    pthread_mutex_unlock(&open_files_lock);
+
+    flush_delalloc();
     flush_inode_cache();
     flush_block_cache();
-    return 0;
+
+    // The descriptor is closed either way, the data stays pending
+    return get_writeback_error(inode_id);
 }
 
-int sfs_fwrite(int fd, const char* buf, int ln){
+int sfs_fpwrite(int fd, const char* buf, int ln, int offset){
     if(fd < 0 || fd >= MAX_OPEN_FILES){
         printf("Error: Could not read file - Invalid file descriptor\n\n");
         exit(1);
     }
 
-    if(opened_files[fd] == -1){
+    uint32_t inode_id = get_open_file(fd);
+    if(inode_id == -1){
         return -1;
     }
 
     inode_t inode;
-    get_inode(opened_files[fd], &inode);
+    if(get_open_inode(inode_id, &inode, 1)){
+        return -1;
+    }
 
-    int i = write_to_inode(opened_files[fd], &inode, file_offset[fd], buf, ln);
-    write_inode(&inode, opened_files[fd]);
+    int i = write_to_inode(inode_id, &inode, offset, (byte_t *) buf, ln);
+    write_inode(&inode, inode_id);
     flush_inode_cache();
 
-    file_offset[fd] += i;
-
+    unlock_inode(inode_id);
     return i;
 }
 
-int sfs_fread(int fd, char* buf, int ln){
+int sfs_fpread(int fd, char* buf, int ln, int offset){
     if(fd < 0 || fd >= MAX_OPEN_FILES){
         printf("Error: Could not read file - Invalid file descriptor\n\n");
         exit(1);
     }
 
-    if(opened_files[fd] == -1){
+    uint32_t inode_id = get_open_file(fd);
+    if(inode_id == -1){
         return -1;
     }
 
     inode_t inode;
-    get_inode(opened_files[fd], &inode);
+    if(get_open_inode(inode_id, &inode, 0)){
+        return -1;
+    }
+
+    // Write back failed earlier, retry it before reporting the error
+    if(get_writeback_error(inode_id)){
+        unlock_inode(inode_id);
+        if(get_open_inode(inode_id, &inode, 1)){
+            return -1;
+        }
 
-    int i = read_from_inode(&inode, file_offset[fd], ln, buf);
+        int failed = flush_delalloc_inode(inode_id, &inode);
+        write_inode(&inode, inode_id);
+        if(failed){
+            unlock_inode(inode_id);
+            return -1;
+        }
+    }
+
+    int i = read_from_inode(inode_id, &inode, offset, ln, buf);
+
+    unlock_inode(inode_id);
+    return i;
+}
+
+int sfs_fwrite(int fd, const char* buf, int ln){
+    if(fd < 0 || fd >= MAX_OPEN_FILES){
+        printf("Error: Could not read file - Invalid file descriptor\n\n");
+        exit(1);
+    }
+
+    int i = sfs_fpwrite(fd, buf, ln, file_offset[fd]);
+    if(i == -1){
+        return -1;
+    }
+
+    file_offset[fd] += i;
+
+    return i;
+}
+
+int sfs_fread(int fd, char* buf, int ln){
+    if(fd < 0 || fd >= MAX_OPEN_FILES){
+        printf("Error: Could not read file - Invalid file descriptor\n\n");
+        exit(1);
+    }
+
+    int i = sfs_fpread(fd, buf, ln, file_offset[fd]);
+    if(i == -1){
+        return -1;
+    }
 
     file_offset[fd] += ln;
 
@@ -269,22 +418,166 @@ int sfs_fseek(int fd, int offset){
     return 0;
 }
 
+int sfs_fallocate(int fd, int offset, int len){
+    if(fd < 0 || fd >= MAX_OPEN_FILES){
+        printf("Error: Could not preallocate file - Invalid file descriptor\n\n");
+        exit(1);
+    }
+
+    uint32_t inode_id = get_open_file(fd);
+    if(inode_id == -1 || offset < 0 || len <= 0){
+        return -1;
+    }
+
+    inode_t inode;
+    if(get_open_inode(inode_id, &inode, 1)){
+        return -1;
+    }
+
+    int result = preallocate_inode(inode_id, &inode, offset, len);
+
+    unlock_inode(inode_id);
+    return result;
+}
+
+int sfs_ftruncate(int fd, int size){
+    if(fd < 0 || fd >= MAX_OPEN_FILES){
+        printf("Error: Could not truncate file - Invalid file descriptor\n\n");
+        exit(1);
+    }
+
+    uint32_t inode_id = get_open_file(fd);
+    if(inode_id == -1 || size < 0){
+        return -1;
+    }
+
+    inode_t inode;
+    if(get_open_inode(inode_id, &inode, 1)){
+        return -1;
+    }
+
+    int result = truncate_inode(inode_id, &inode, size);
+
+    unlock_inode(inode_id);
+    return result;
+}
+
+static int seek_file(int fd, int offset, int data){
+    if(fd < 0 || fd >= MAX_OPEN_FILES){
+        printf("Error: Could not seek file - Invalid file descriptor\n\n");
+        exit(1);
+    }
+
+    uint32_t inode_id = get_open_file(fd);
+    if(inode_id == -1 || offset < 0){
+        return -1;
+    }
+
+    inode_t inode;
+    if(get_open_inode(inode_id, &inode, 0)){
+        return -1;
+    }
+
+    int found = seek_inode(inode_id, &inode, offset, data);
+    unlock_inode(inode_id);
+
+    if(found != -1){
+        file_offset[fd] = found;
+    }
+
+    return found;
+}
+
+int sfs_fseekdata(int fd, int offset){
+    return seek_file(fd, offset, 1);
+}
+
+int sfs_fseekhole(int fd, int offset){
+    return seek_file(fd, offset, 0);
+}
+
 int sfs_remove(char* name){
-    for(int i = 0; i < get_dir_table_size(); i++){
-        if(strcmp(name, get_dir_table_entry(i)->filename) == 0){
-            int n = get_dir_table_entry(i)->inode;
-
-            for(int j = 0; j < MAX_OPEN_FILES; j++){
-                if(opened_files[j] == n){
-                    sfs_fclose(j);
-                }
-            }
-
-            remove_inode(n);
-            remove_from_dir_table(i);
-            return n;
+    pthread_mutex_lock(&open_files_lock);
+
+    int i = find_dir_table_entry(name);
+    if(i == -1){
+        pthread_mutex_unlock(&open_files_lock);
+        return -1;
+    }
+
+    int n = get_dir_table_entry(i)->inode;
+
+    for(int j = 0; j < MAX_OPEN_FILES; j++){
+        if(opened_files[j] == n){
+            sfs_fclose(j);
         }
     }
 
-    return -1;
+    lock_inode(n, 1);
+    remove_inode(n);
+    unlock_inode(n);
+
+    remove_from_dir_table(i);
+
+    pthread_mutex_unlock(&open_files_lock);
+    return n;
+}
+
+int sfs_clone(char* src, char* dst){
+    if(strlen(dst) > MAXFILENAME){
+        return -1;
+    }
+
+    pthread_mutex_lock(&open_files_lock);
+
+    if(find_dir_table_entry(dst) != -1){
+        printf("Error: Could not clone file - %s already exists\n\n", dst);
+        pthread_mutex_unlock(&open_files_lock);
+        return -1;
+    }
+
+    int src_entry = find_dir_table_entry(src);
+    if(src_entry == -1){
+        pthread_mutex_unlock(&open_files_lock);
+        return -1;
+    }
+    int src_inode = get_dir_table_entry(src_entry)->inode;
+
+    uint32_t inode_id = alloc_inode();
+    if(inode_id == -1){
+        pthread_mutex_unlock(&open_files_lock);
+        return -1;
+    }
+
+    // The copy is not reachable yet and needs no lock of its own
+    inode_t node;
+    lock_inode(src_inode, 1);
+    get_inode(src_inode, &node);
+
+    inode_t copy;
+    memset(&copy, 0, sizeof(inode_t));
+    copy.mode = node.mode;
+    copy.link_count = 1;
+
+    int failed = clone_inode(src_inode, &node, inode_id, &copy);
+    unlock_inode(src_inode);
+
+    if(failed){
+        release_inode(inode_id);
+        pthread_mutex_unlock(&open_files_lock);
+        return -1;
+    }
+
+    dir_entry_t entry;
+    memset(&entry, 0, sizeof(dir_entry_t));
+    entry.valid = 1;
+    entry.inode = inode_id;
+    strcpy(entry.filename, dst);
+
+    write_to_dir_table(get_free_dir_table_entry(), &entry);
+    pthread_mutex_unlock(&open_files_lock);
+
+    flush_inode_cache();
+    flush_block_cache();
+    return 0;
 }
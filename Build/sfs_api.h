@@ -4,19 +4,33 @@
 #include <stdint.h>
 
 // 
-#define MAGIC_NUMBER 0xABCD0005
+#define MAGIC_NUMBER 0xABCD0006
 #define BLOCK_SIZE 1024
 #define NUM_BLOCKS 2048
-#define NUM_FREE_BLOCKS (NUM_BLOCKS / 8 / BLOCK_SIZE + 1)
+#define NUM_FREE_BLOCKS ((NUM_BLOCKS + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8))
+#define NUM_SHARE_BLOCKS ((NUM_BLOCKS * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE)
 #define POINTER_SIZE 4
 
+#define BLOCKS_PER_GROUP 512
+#define NUM_GROUPS ((NUM_BLOCKS + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP)
+#define ALLOC_GOAL_WINDOW 128
+
 #define BLOCK_CACHE_SIZE 16
 #define INODE_CACHE_SIZE 16
-
-#define INODE_SIZE 64
+#define INODE_HASH_SIZE 32
+#define DIR_HASH_SIZE 4096
+#define DELALLOC_MAX_BLOCKS 64
+#define DIRECT_WRITE_MIN_BLOCKS 8
+#define EXTENT_RESERVE_BLOCKS 4
+#define INODE_LOCK_COUNT 64
+
+#define INODE_SIZE 256
 #define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
-#define INODE_DIRECT_ACCESS 12
-#define INODE_MAX_BLOCKS (INODE_DIRECT_ACCESS + (BLOCK_SIZE / POINTER_SIZE))
+#define INODE_EXTENTS 19
+// Offsets are passed around as int
+#define INODE_MAX_SIZE 0x7FFFFFFF
+// Blocks added to the i-node table at a time
+#define INODE_TABLE_CHUNK 4
 
 #define DIR_ENTRY_SIZE 64
 #define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / DIR_ENTRY_SIZE)
@@ -37,6 +51,12 @@ int sfs_getnextfilename(char*);
 
 int sfs_getfilesize(const char*);
 
+int sfs_getfreeblocks();
+
+// I-nodes left for new files, counting those the i-node table can still
+// grow to hold with the free blocks
+int sfs_getfreeinodes();
+
 int sfs_fopen(char*);
 
 int sfs_fclose(int);
@@ -45,8 +65,28 @@ int sfs_fwrite(int, const char*, int);
 
 int sfs_fread(int, char*, int);
 
+// Read and write at an offset without moving the file position, so that
+// threads can share a descriptor
+int sfs_fpwrite(int, const char*, int, int);
+int sfs_fpread(int, char*, int, int);
+
 int sfs_fseek(int, int);
 
 int sfs_remove(char*);
 
+// Creates a file sharing the data blocks of another, blocks are copied
+// the first time either file writes to them
+int sfs_clone(char*, char*);
+
+// Maps blocks for a range ahead of the writes, the file size is unchanged
+int sfs_fallocate(int, int, int);
+
+// Sets the file size, blocks past the new end are freed and growing leaves a hole
+int sfs_ftruncate(int, int);
+
+// Moves to the next data or hole at or after an offset, like SEEK_DATA and
+// SEEK_HOLE, and returns it. -1 past the end of file
+int sfs_fseekdata(int, int);
+int sfs_fseekhole(int, int);
+
 #endif
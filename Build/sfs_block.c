@@ -5,7 +5,9 @@
 #include <time.h>
 #include <math.h>
 #include <string.h>
+#include <pthread.h>
 #include "sfs_block.h"
+#include "sfs_inode.h"
 #include "sfs_api.h"
 
 // Block Cache
@@ -14,6 +16,27 @@ uint32_t block_cache_index[BLOCK_CACHE_SIZE];
 uint16_t block_cache_age[BLOCK_CACHE_SIZE];
 uint16_t block_rolling_counter = 1;
 
+// Metadata partition (superblock, free bitmap, share table and i-node table blocks)
+// Pinned for the lifetime of the mount, never competes with data blocks
+block_t *meta_cache[NUM_BLOCKS];
+uint8_t meta_cache_dirty[NUM_BLOCKS];
+
+// In-memory free bitmap, one bit per block (1 = used), synced to disk on flush
+uint64_t free_bitmap[BITMAP_WORDS];
+uint8_t free_bitmap_dirty[NUM_FREE_BLOCKS];
+
+// Free space summary levels: one bit per bitmap word (set when the word has
+// a free bit) and a free count per on-disk bitmap block
+uint64_t free_summary[SUMMARY_WORDS];
+uint32_t bitmap_block_free[NUM_FREE_BLOCKS];
+
+// One lock per allocation group, guards its bitmap words and counters
+pthread_mutex_t group_lock[NUM_GROUPS];
+
+// Guards both caches, the share table and the disk, which has a single
+// file position. Taken before any group lock
+pthread_mutex_t cache_lock;
+
 // In-memory
 superblock_t *superblock = NULL;
 
@@ -21,6 +44,15 @@ superblock_t* get_superblock(){
     return superblock;
 }
 
+// Lets a layer call back into its own locked functions
+void init_recursive_lock(pthread_mutex_t* lock){
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
 // Block cache management
 void init_block_cache(){
     // Invalidate cache upon initialization
@@ -28,9 +60,35 @@ void init_block_cache(){
         block_cache_index[i] = -1;
     }
 
+    for(int i = 0; i < NUM_BLOCKS; i++){
+        if(meta_cache[i] != NULL){
+            free(meta_cache[i]);
+            meta_cache[i] = NULL;
+        }
+        meta_cache_dirty[i] = 0;
+    }
+
+    memset(free_bitmap, 0, sizeof(free_bitmap));
+    memset(free_bitmap_dirty, 0, sizeof(free_bitmap_dirty));
+
+    // Bits past the end of the disk never count as free
+    for(uint32_t i = NUM_BLOCKS; i < BITMAP_WORDS * 64; i++){
+        free_bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+    rebuild_free_summary();
+
+    for(int i = 0; i < NUM_GROUPS; i++){
+        pthread_mutex_init(&group_lock[i], NULL);
+    }
+    init_recursive_lock(&cache_lock);
+
+    if(superblock != NULL){
+        free(superblock);
+    }
     superblock = calloc(1, sizeof(superblock_t));
 }
 
+// Called with the cache locked
 uint32_t get_oldest_block(){
     uint32_t oldest_index = 0;
     for(int i = 0; i < BLOCK_CACHE_SIZE; i++){
@@ -47,11 +105,13 @@ uint32_t get_oldest_block(){
 }
 
 void _write_block(uint32_t block_num, block_t* block){
+    pthread_mutex_lock(&cache_lock);
 
     for(int i = 0; i < BLOCK_CACHE_SIZE; i++){
         if(block_cache_index[i] == block_num){
             memcpy(block_cache[i].data, block->data, BLOCK_SIZE);
             block_cache_age[i] = block_rolling_counter;
+            pthread_mutex_unlock(&cache_lock);
             return;
         }
     }
@@ -60,6 +120,7 @@ void _write_block(uint32_t block_num, block_t* block){
 
     if(oldest == -1){
         printf("Error: Failed to find oldest block in cache\n");
+        pthread_mutex_unlock(&cache_lock);
         return;
     }
 
@@ -67,14 +128,65 @@ void _write_block(uint32_t block_num, block_t* block){
     memcpy(block_cache[oldest].data, block->data, BLOCK_SIZE);
     block_cache_index[oldest] = block_num;
     block_cache_age[oldest] = block_rolling_counter;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Drops stale copies of blocks that are about to be written directly or
+// were freed, pinned copies would otherwise be written back over new data
+void drop_cached_blocks(uint32_t start, uint32_t length){
+    pthread_mutex_lock(&cache_lock);
+
+    for(int i = 0; i < BLOCK_CACHE_SIZE; i++){
+        if(block_cache_index[i] != -1 && block_cache_index[i] >= start && block_cache_index[i] < start + length){
+            block_cache_index[i] = -1;
+        }
+    }
+
+    for(uint32_t i = start; i < start + length && i < NUM_BLOCKS; i++){
+        if(meta_cache[i] != NULL){
+            free(meta_cache[i]);
+            meta_cache[i] = NULL;
+            meta_cache_dirty[i] = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// A cached copy may be newer than the disk, direct reads must not skip it
+int is_block_cached(uint32_t block_num){
+    pthread_mutex_lock(&cache_lock);
+
+    int cached = meta_cache[block_num] != NULL;
+    for(int i = 0; i < BLOCK_CACHE_SIZE && !cached; i++){
+        cached = block_cache_index[i] == block_num;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return cached;
+}
+
+// Uncached transfers of whole runs, for the direct I/O paths
+void read_block_run(uint32_t start, uint32_t length, void* buffer){
+    pthread_mutex_lock(&cache_lock);
+    read_blocks(start, length, buffer);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void write_block_run(uint32_t start, uint32_t length, void* buffer){
+    pthread_mutex_lock(&cache_lock);
+    write_blocks(start, length, buffer);
+    pthread_mutex_unlock(&cache_lock);
 }
 
 void _read_block(uint32_t block_num, block_t* block){
+    pthread_mutex_lock(&cache_lock);
 
     for(int i = 0; i < BLOCK_CACHE_SIZE; i++){
         if(block_cache_index[i] == block_num){
             memcpy(block->data, block_cache[i].data, BLOCK_SIZE);
             block_cache_age[i] = block_rolling_counter;
+            pthread_mutex_unlock(&cache_lock);
             return;
         }
     }
@@ -90,47 +202,591 @@ void _read_block(uint32_t block_num, block_t* block){
     memcpy(block_cache[oldest].data, block->data, BLOCK_SIZE);
     block_cache_index[oldest] = block_num;
     block_cache_age[oldest] = block_rolling_counter;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Metadata partition management. A pinned block stays put until it is
+// freed, its contents are guarded by the lock of whatever it holds
+block_t* get_meta_block(uint32_t block_num){
+    pthread_mutex_lock(&cache_lock);
+
+    if(meta_cache[block_num] != NULL){
+        pthread_mutex_unlock(&cache_lock);
+        return meta_cache[block_num];
+    }
+
+    meta_cache[block_num] = malloc(sizeof(block_t));
+
+    // A copy in the data partition is newer than the disk, adopt it
+    for(int i = 0; i < BLOCK_CACHE_SIZE; i++){
+        if(block_cache_index[i] == block_num){
+            memcpy(meta_cache[block_num]->data, block_cache[i].data, BLOCK_SIZE);
+            block_cache_index[i] = -1;
+            pthread_mutex_unlock(&cache_lock);
+            return meta_cache[block_num];
+        }
+    }
+
+    read_blocks(block_num, 1, meta_cache[block_num]->data);
+    pthread_mutex_unlock(&cache_lock);
+    return meta_cache[block_num];
+}
+
+// Pins a zeroed copy of a block whose disk contents are stale, without reading it
+block_t* new_meta_block(uint32_t block_num){
+    pthread_mutex_lock(&cache_lock);
+
+    if(meta_cache[block_num] == NULL){
+        meta_cache[block_num] = malloc(sizeof(block_t));
+    }
+
+    for(int i = 0; i < BLOCK_CACHE_SIZE; i++){
+        if(block_cache_index[i] == block_num){
+            block_cache_index[i] = -1;
+        }
+    }
+
+    memset(meta_cache[block_num]->data, 0, BLOCK_SIZE);
+    meta_cache_dirty[block_num] = 1;
+    pthread_mutex_unlock(&cache_lock);
+    return meta_cache[block_num];
+}
+
+void mark_meta_block_dirty(uint32_t block_num){
+    pthread_mutex_lock(&cache_lock);
+    meta_cache_dirty[block_num] = 1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void _read_meta_block(uint32_t block_num, block_t* block){
+    memcpy(block->data, get_meta_block(block_num)->data, BLOCK_SIZE);
+}
+
+void _write_meta_block(uint32_t block_num, block_t* block){
+    memcpy(get_meta_block(block_num)->data, block->data, BLOCK_SIZE);
+    mark_meta_block_dirty(block_num);
+}
+
+void flush_meta_cache(){
+    pthread_mutex_lock(&cache_lock);
+    for(int i = 0; i < NUM_BLOCKS; i++){
+        if(meta_cache_dirty[i]){
+            write_blocks(i, 1, meta_cache[i]->data);
+            meta_cache_dirty[i] = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Free bitmap management
+void load_free_bitmap(){
+    for(int i = 0; i < NUM_FREE_BLOCKS; i++){
+        block_t *block = get_meta_block(superblock->file_system_size - 1 - i);
+
+        for(int j = 0; j < BLOCK_SIZE && i * BLOCK_SIZE + j < BITMAP_WORDS * 8; j++){
+            uint32_t byte_num = i * BLOCK_SIZE + j;
+            free_bitmap[byte_num / 8] |= (uint64_t)block->data[j] << (byte_num % 8 * 8);
+        }
+    }
+
+    rebuild_free_summary();
+
+    // Recount rather than trust the summary of an unclean image
+    superblock->free_block_count = 0;
+    for(int g = 0; g < NUM_GROUPS; g++){
+        group_desc_t *group = &superblock->groups[g];
+
+        group->free_block_count = 0;
+        for(uint32_t i = get_group_start(g) / 64; i < (get_group_end(g) + 63) / 64; i++){
+            group->free_block_count += 64 - __builtin_popcountll(free_bitmap[i]);
+        }
+        superblock->free_block_count += group->free_block_count;
+
+        if(group->first_free_hint < get_group_start(g) || group->first_free_hint >= get_group_end(g)){
+            group->first_free_hint = get_group_start(g);
+        }
+    }
+}
+
+// Copies the free space counters into `snapshot` (if any) while the
+// bitmap written out matches them
+void sync_free_bitmap(superblock_t* snapshot){
+    pthread_mutex_lock(&cache_lock);
+    for(int g = 0; g < NUM_GROUPS; g++){
+        pthread_mutex_lock(&group_lock[g]);
+    }
+
+    if(snapshot != NULL){
+        snapshot->free_block_count = get_free_block_count();
+        memcpy(snapshot->groups, superblock->groups, sizeof(snapshot->groups));
+    }
+
+    for(int i = 0; i < NUM_FREE_BLOCKS; i++){
+        if(!free_bitmap_dirty[i]){
+            continue;
+        }
+
+        uint32_t bitmap_block = superblock->file_system_size - 1 - i;
+        block_t *block = get_meta_block(bitmap_block);
+
+        for(int j = 0; j < BLOCK_SIZE && i * BLOCK_SIZE + j < BITMAP_WORDS * 8; j++){
+            uint32_t byte_num = i * BLOCK_SIZE + j;
+            block->data[j] = (free_bitmap[byte_num / 8] >> (byte_num % 8 * 8)) & 0xFF;
+        }
+
+        mark_meta_block_dirty(bitmap_block);
+        free_bitmap_dirty[i] = 0;
+    }
+
+    for(int g = NUM_GROUPS - 1; g >= 0; g--){
+        pthread_mutex_unlock(&group_lock[g]);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void rebuild_free_summary(){
+    memset(free_summary, 0, sizeof(free_summary));
+    memset(bitmap_block_free, 0, sizeof(bitmap_block_free));
+
+    for(uint32_t i = 0; i < BITMAP_WORDS; i++){
+        if(free_bitmap[i] != ~(uint64_t)0){
+            free_summary[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+        bitmap_block_free[i / WORDS_PER_BITMAP_BLOCK] += 64 - __builtin_popcountll(free_bitmap[i]);
+    }
+}
+
+// Keeps the summary bit of one bitmap word in sync, words of different
+// groups share a summary word so the update is atomic
+void update_free_summary(uint32_t word){
+    uint64_t bit = (uint64_t)1 << (word % 64);
+
+    if(free_bitmap[word] != ~(uint64_t)0){
+        __atomic_or_fetch(&free_summary[word / 64], bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_and_fetch(&free_summary[word / 64], ~bit, __ATOMIC_RELAXED);
+    }
+}
+
+// Allocation groups
+uint32_t get_group_start(uint32_t group){
+    return group * BLOCKS_PER_GROUP;
+}
+
+uint32_t get_group_end(uint32_t group){
+    uint32_t end = (group + 1) * BLOCKS_PER_GROUP;
+    return end < NUM_BLOCKS ? end : NUM_BLOCKS;
+}
+
+uint32_t get_group_free_count(uint32_t group){
+    pthread_mutex_lock(&group_lock[group]);
+    uint32_t free_count = superblock->groups[group].free_block_count;
+    pthread_mutex_unlock(&group_lock[group]);
+
+    return free_count;
+}
+
+// Default goal for a file, the group's first free block so that runs
+// allocated from it grow forward inside the group
+uint32_t get_group_goal(uint32_t group){
+    group %= NUM_GROUPS;
+
+    pthread_mutex_lock(&group_lock[group]);
+    uint32_t goal = superblock->groups[group].first_free_hint;
+    pthread_mutex_unlock(&group_lock[group]);
+
+    return goal < get_group_end(group) ? goal : get_group_start(group);
+}
+
+// Kept up to date by every group, read without their locks
+uint32_t get_free_block_count(){
+    return __atomic_load_n(&superblock->free_block_count, __ATOMIC_RELAXED);
 }
 
 int is_block_free(uint32_t block_num){
-    uint32_t block_index = block_num / 8 / BLOCK_SIZE;
-    
-    block_t block;
-    _read_block(superblock->file_system_size - 1 -  block_index, &block);
+    return (free_bitmap[block_num / 64] & ((uint64_t)1 << (block_num % 64))) == 0;
+}
+
+// Caller holds the group lock, the run must not cross a group boundary
+void mark_group_run(uint32_t start, uint32_t length, int status){
+    group_desc_t *group = &superblock->groups[start / BLOCKS_PER_GROUP];
+    uint32_t end = start + length;
+
+    // Flip up to 64 bits per step
+    for(uint32_t block_num = start; block_num < end;){
+        uint32_t bits = 64 - block_num % 64;
+        if(bits > end - block_num){
+            bits = end - block_num;
+        }
+
+        uint64_t mask = (bits == 64) ? ~(uint64_t)0 : ((((uint64_t)1 << bits) - 1) << (block_num % 64));
+        uint32_t changed;
+        if(status == 1){
+            changed = __builtin_popcountll(mask & ~free_bitmap[block_num / 64]);
+            free_bitmap[block_num / 64] |= mask;
+
+            group->free_block_count -= changed;
+            __atomic_sub_fetch(&bitmap_block_free[block_num / 64 / WORDS_PER_BITMAP_BLOCK], changed, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&superblock->free_block_count, changed, __ATOMIC_RELAXED);
+        } else {
+            changed = __builtin_popcountll(mask & free_bitmap[block_num / 64]);
+            free_bitmap[block_num / 64] &= ~mask;
+
+            group->free_block_count += changed;
+            __atomic_add_fetch(&bitmap_block_free[block_num / 64 / WORDS_PER_BITMAP_BLOCK], changed, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&superblock->free_block_count, changed, __ATOMIC_RELAXED);
+        }
+
+        update_free_summary(block_num / 64);
+        __atomic_store_n(&free_bitmap_dirty[block_num / 8 / BLOCK_SIZE], 1, __ATOMIC_RELAXED);
+        block_num += bits;
+    }
+
+    if(status == 0 && length > 0 && start < group->first_free_hint){
+        group->first_free_hint = start;
+    }
+}
 
-   return (block.data[block_num / 8 % BLOCK_SIZE] & (1 << (block_num % 8))) == 0;
+void set_block_run_status(uint32_t start, uint32_t length, int status){
+    uint32_t end = start + length;
+
+    while(start < end){
+        uint32_t group = start / BLOCKS_PER_GROUP;
+        uint32_t group_length = get_group_end(group) - start;
+        if(group_length > end - start){
+            group_length = end - start;
+        }
+
+        pthread_mutex_lock(&group_lock[group]);
+        mark_group_run(start, group_length, status);
+        pthread_mutex_unlock(&group_lock[group]);
+
+        start += group_length;
+    }
 }
 
 void set_block_status(uint32_t block_num, int status){
-    uint32_t block_index = block_num / 8 / BLOCK_SIZE;
-    
-    block_t block;
-    _read_block(superblock->file_system_size - 1 -  block_index, &block);
+    set_block_run_status(block_num, 1, status);
+}
 
-    if(status == 1){
-        block.data[block_num / 8 % BLOCK_SIZE] |= (1 << (block_num % 8));
-    } else {
-        block.data[block_num / 8 % BLOCK_SIZE] &= ~(1 << (block_num % 8));
+int compare_block_nums(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : (x > y);
+}
+
+// Block sharing: the share table just before the free bitmap holds one
+// counter per block, the number of files using it besides the first
+uint32_t get_share_table_start(){
+    return superblock->file_system_size - NUM_FREE_BLOCKS - NUM_SHARE_BLOCKS;
+}
+
+static uint16_t* get_share_counter(uint32_t block_num){
+    block_t *block = get_meta_block(get_share_table_start() + block_num / SHARES_PER_BLOCK);
+    return (uint16_t*)block->data + block_num % SHARES_PER_BLOCK;
+}
+
+uint32_t get_block_shares(uint32_t block_num){
+    pthread_mutex_lock(&cache_lock);
+    uint32_t shares = *get_share_counter(block_num);
+    pthread_mutex_unlock(&cache_lock);
+
+    return shares;
+}
+
+// Adds a user to every block of a run, fails without changing anything
+// when one of them is at its limit
+int share_block_run(uint32_t start, uint32_t length){
+    pthread_mutex_lock(&cache_lock);
+
+    for(uint32_t i = start; i < start + length; i++){
+        if(*get_share_counter(i) == MAX_BLOCK_SHARES){
+            printf("Error: Block %d is shared too many times\n", i);
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+    }
+
+    for(uint32_t i = start; i < start + length; i++){
+        (*get_share_counter(i))++;
+        mark_meta_block_dirty(get_share_table_start() + i / SHARES_PER_BLOCK);
     }
 
-    _write_block(superblock->file_system_size - 1 -  block_index, &block);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
 }
 
-uint32_t get_next_free_block(){
-    for(int i = NUM_BLOCKS - 1; i >= 0; i--){
-        if(is_block_free(i)){
-            return i;
+// Bulk free: sorts the list so that consecutive blocks are cleared a word
+// at a time, with one lock round trip per run. Cached copies are dropped
+// so that dead data is never written back. Shared blocks only lose a user.
+void free_block_list(uint32_t* blocks, uint32_t count){
+    uint32_t kept = 0;
+    pthread_mutex_lock(&cache_lock);
+    for(uint32_t i = 0; i < count; i++){
+        uint16_t *shares = get_share_counter(blocks[i]);
+        if(*shares > 0){
+            (*shares)--;
+            mark_meta_block_dirty(get_share_table_start() + blocks[i] / SHARES_PER_BLOCK);
+        } else {
+            blocks[kept++] = blocks[i];
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    count = kept;
+
+    qsort(blocks, count, sizeof(uint32_t), compare_block_nums);
+
+    for(uint32_t i = 0; i < count;){
+        uint32_t run_length = 1;
+        while(i + run_length < count && blocks[i + run_length] == blocks[i] + run_length){
+            run_length++;
+        }
+
+        set_block_run_status(blocks[i], run_length, 0);
+        drop_cached_blocks(blocks[i], run_length);
+
+        i += run_length;
+    }
+}
+
+// First free block in [from, end), or -1. Full bitmap blocks and full
+// words are skipped through the summary levels without being read.
+int64_t find_free_block(uint32_t from, uint32_t end){
+    if(from >= end){
+        return -1;
+    }
+
+    uint32_t word = from / 64;
+    uint64_t free_bits = ~free_bitmap[word] & (~(uint64_t)0 << (from % 64));
+
+    if(free_bits == 0){
+        word++;
+
+        while(1){
+            if(word * 64 >= end){
+                return -1;
+            }
+
+            uint32_t bitmap_index = word / WORDS_PER_BITMAP_BLOCK;
+            if(__atomic_load_n(&bitmap_block_free[bitmap_index], __ATOMIC_RELAXED) == 0){
+                word = (bitmap_index + 1) * WORDS_PER_BITMAP_BLOCK;
+                continue;
+            }
+
+            uint64_t summary = __atomic_load_n(&free_summary[word / 64], __ATOMIC_RELAXED) & (~(uint64_t)0 << (word % 64));
+            if(summary == 0){
+                word = (word / 64 + 1) * 64;
+                continue;
+            }
+
+            word = word / 64 * 64 + __builtin_ctzll(summary);
+            if(word * 64 >= end){
+                return -1;
+            }
+            free_bits = ~free_bitmap[word];
+            break;
+        }
+    }
+
+    int64_t block_num = (int64_t)word * 64 + __builtin_ctzll(free_bits);
+    return block_num < end ? block_num : -1;
+}
+
+// First run of free blocks in [from, end), or -1
+int64_t find_free_run(uint32_t from, uint32_t end, uint32_t* length){
+    int64_t start = find_free_block(from, end);
+    if(start == -1){
+        return -1;
+    }
+
+    int64_t word = start / 64;
+
+    uint64_t used_bits = free_bitmap[word] & (~(uint64_t)0 << (start % 64));
+    while(used_bits == 0 && ++word < (end + 63) / 64){
+        used_bits = free_bitmap[word];
+    }
+
+    int64_t run_end = used_bits == 0 ? end : word * 64 + __builtin_ctzll(used_bits);
+    *length = (run_end < end ? run_end : end) - start;
+    return start;
+}
+
+// Best fit inside one group: the smallest run that fits, preferring the
+// goal window, otherwise the largest run. Caller holds the group lock.
+int64_t find_group_run(uint32_t group, uint32_t goal, uint32_t count, uint32_t* length){
+    group_desc_t *desc = &superblock->groups[group];
+    uint32_t group_end = get_group_end(group);
+
+    int64_t best_start = -1;
+    uint32_t best_length = 0;
+    uint32_t best_distance = 0;
+
+    uint32_t run_length;
+    int64_t run_start = find_free_run(desc->first_free_hint, group_end, &run_length);
+
+    // Everything below the first free run is in use
+    desc->first_free_hint = run_start == -1 ? group_end : run_start;
+
+    for(; run_start != -1; run_start = find_free_run(run_start + run_length, group_end, &run_length)){
+        uint32_t run_end = run_start + run_length - 1;
+        uint32_t distance = goal < run_start ? run_start - goal : goal - run_end;
+
+        if(best_start == -1){
+            best_start = run_start;
+            best_length = run_length;
+            best_distance = distance;
+            continue;
+        }
+
+        int fits = run_length >= count;
+        int best_fits = best_length >= count;
+
+        if(fits != best_fits){
+            if(fits){
+                best_start = run_start;
+                best_length = run_length;
+                best_distance = distance;
+            }
+            continue;
+        }
+
+        if(!fits){
+            if(run_length > best_length){
+                best_start = run_start;
+                best_length = run_length;
+                best_distance = distance;
+            }
+            continue;
+        }
+
+        int in_window = distance <= ALLOC_GOAL_WINDOW;
+        int best_in_window = best_distance <= ALLOC_GOAL_WINDOW;
+
+        if((in_window && !best_in_window)
+            || (in_window == best_in_window && (run_length < best_length || (run_length == best_length && distance < best_distance)))){
+            best_start = run_start;
+            best_length = run_length;
+            best_distance = distance;
+        }
+    }
+
+    if(best_start == -1){
+        *length = 0;
+        return -1;
+    }
+
+    *length = best_length < count ? best_length : count;
+
+    // Place the allocation on the side of the run facing the goal
+    if(goal > best_start + best_length - 1){
+        return best_start + best_length - *length;
+    }
+    return best_start;
+}
+
+// Contiguous allocation: marks up to `count` free blocks as used, placed as
+// close to `goal` as possible, and returns the start of the run. `extend`
+// is set when `goal` follows the caller's last block. The run length goes
+// in `length`, 0 when the disk is full.
+uint32_t alloc_block_run(uint32_t goal, int extend, uint32_t count, uint32_t* length){
+    if(goal >= NUM_BLOCKS){
+        goal = get_group_goal(0);
+    }
+    uint32_t goal_group = goal / BLOCKS_PER_GROUP;
+
+    // Extending in place is always the best option. A new run only starts
+    // at the goal when it fits there whole, a sliver would split the file
+    pthread_mutex_lock(&group_lock[goal_group]);
+    if(is_block_free(goal)){
+        uint32_t run_length;
+        find_free_run(goal, get_group_end(goal_group), &run_length);
+
+        if(extend || run_length >= count){
+            *length = run_length < count ? run_length : count;
+            mark_group_run(goal, *length, 1);
+
+            pthread_mutex_unlock(&group_lock[goal_group]);
+            return goal;
+        }
+    }
+    pthread_mutex_unlock(&group_lock[goal_group]);
+
+    // The goal's group first, then the following ones, skipping full groups
+    int64_t partial_group = -1;
+    uint32_t partial_length = 0;
+
+    for(int i = 0; i < NUM_GROUPS; i++){
+        uint32_t group = (goal_group + i) % NUM_GROUPS;
+        if(superblock->groups[group].free_block_count == 0){
+            continue;
+        }
+
+        pthread_mutex_lock(&group_lock[group]);
+
+        uint32_t run_length;
+        int64_t run_start = find_group_run(group, goal, count, &run_length);
+
+        if(run_length == count){
+            mark_group_run(run_start, run_length, 1);
+            pthread_mutex_unlock(&group_lock[group]);
+
+            *length = run_length;
+            return run_start;
         }
+        pthread_mutex_unlock(&group_lock[group]);
+
+        if(run_length > partial_length){
+            partial_group = group;
+            partial_length = run_length;
+        }
+    }
+
+    // Nothing fits, settle for the largest run seen
+    *length = 0;
+    if(partial_group == -1){
+        return -1;
     }
 
-    printf("Error: No free blocks\n");
-    exit(1);
+    pthread_mutex_lock(&group_lock[partial_group]);
+    int64_t run_start = find_group_run(partial_group, goal, count, length);
+    if(*length > 0){
+        mark_group_run(run_start, *length, 1);
+    }
+    pthread_mutex_unlock(&group_lock[partial_group]);
+
+    return run_start;
 }
 
 void flush_block_cache(){
+    // The i-node fields of the superblock and the i-node table map change
+    // under the i-node cache lock, the group fields under the group locks
+    lock_inode_cache();
+    pthread_mutex_lock(&cache_lock);
+
+    superblock_t *snapshot = calloc(1, sizeof(superblock_t));
+    snapshot->magic = superblock->magic;
+    snapshot->block_size = superblock->block_size;
+    snapshot->file_system_size = superblock->file_system_size;
+    snapshot->inode_table_length = superblock->inode_table_length;
+    snapshot->root_dir_inode = superblock->root_dir_inode;
+    snapshot->free_inode_count = superblock->free_inode_count;
+    snapshot->free_inode_hint = superblock->free_inode_hint;
+    snapshot->inode_table_initialized = superblock->inode_table_initialized;
+    snapshot->inode_table_map = superblock->inode_table_map;
+
+    sync_free_bitmap(snapshot);
+
+    // Free space counters and allocation hints live in the superblock
+    _write_meta_block(0, (block_t*)snapshot);
+    free(snapshot);
+
     for(int i = 0; i < BLOCK_CACHE_SIZE; i++){
         if(block_cache_index[i] != -1){
             write_blocks(block_cache_index[i], 1, block_cache[i].data);
         }
     }
+
+    flush_meta_cache();
+    pthread_mutex_unlock(&cache_lock);
+    unlock_inode_cache();
 }
\ No newline at end of file
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sfs_api.h"
+#include "sfs_block.h"
+#include "sfs_extent.h"
+
+// Bumped on every map change, lets callers cache lookups
+uint32_t extent_generation = 0;
+
+// In-memory copy of a tree node, one record past capacity so that an
+// insert can overflow the node before it is split
+typedef struct _extent_node_t {
+    extent_header_t header;
+    extent_t records[EXTENTS_PER_BLOCK + 1];
+} extent_node_t;
+
+// Tree nodes are pinned in the metadata partition, so lookups through the
+// upper levels of a deep tree never go to disk
+static extent_header_t* get_extent_node(uint32_t block_num){
+    return (extent_header_t*)get_meta_block(block_num)->data;
+}
+
+static extent_t* get_node_records(extent_header_t* header){
+    return (extent_t*)(header + 1);
+}
+
+static void read_extent_node(uint32_t block_num, extent_node_t* node){
+    extent_header_t *header = get_extent_node(block_num);
+
+    node->header = *header;
+    memcpy(node->records, get_node_records(header), header->count * sizeof(extent_t));
+}
+
+static void write_extent_node(uint32_t block_num, extent_node_t* node){
+    block_t *block = get_meta_block(block_num);
+    memset(block->data, 0, BLOCK_SIZE);
+
+    memcpy(block->data, &node->header, sizeof(extent_header_t));
+    memcpy(block->data + sizeof(extent_header_t), node->records, node->header.count * sizeof(extent_t));
+
+    mark_meta_block_dirty(block_num);
+}
+
+static void load_extent_root(extent_root_t* root, extent_node_t* node){
+    node->header = root->header;
+    memcpy(node->records, root->extents, root->header.count * sizeof(extent_t));
+}
+
+static void store_extent_root(extent_root_t* root, extent_node_t* node){
+    root->header = node->header;
+    memcpy(root->extents, node->records, node->header.count * sizeof(extent_t));
+}
+
+// Index of the last record starting at or before `block_num`, -1 if none
+static int find_record(extent_t* records, uint16_t count, uint32_t block_num){
+    int low = 0;
+    int high = count - 1;
+    int found = -1;
+
+    while(low <= high){
+        int mid = (low + high) / 2;
+        if(records[mid].logical <= block_num){
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+static void insert_record(extent_node_t* node, int at, extent_t* record){
+    memmove(&node->records[at + 1], &node->records[at], (node->header.count - at) * sizeof(extent_t));
+    node->records[at] = *record;
+    node->header.count++;
+}
+
+static void remove_record(extent_node_t* node, int at){
+    memmove(&node->records[at], &node->records[at + 1], (node->header.count - at - 1) * sizeof(extent_t));
+    node->header.count--;
+}
+
+static int is_contiguous(extent_t* first, extent_t* second){
+    return first->logical + first->length == second->logical && first->physical + first->length == second->physical;
+}
+
+uint32_t get_extent_generation(){
+    return __atomic_load_n(&extent_generation, __ATOMIC_RELAXED);
+}
+
+void init_extent_root(extent_root_t* root){
+    memset(root, 0, sizeof(extent_root_t));
+}
+
+// Returns 1 and the extent holding `block_num` if it is mapped. Otherwise
+// returns 0 and a hole with `physical` -1 that runs up to the next extent
+int find_extent(extent_root_t* root, uint32_t block_num, extent_t* found){
+    extent_header_t *header = &root->header;
+    extent_t *records = root->extents;
+
+    uint32_t hole_end = UINT32_MAX;
+
+    while(header->depth > 0){
+        int i = find_record(records, header->count, block_num);
+        if(i == -1){
+            i = 0;
+        }
+        if(i + 1 < header->count && records[i + 1].logical < hole_end){
+            hole_end = records[i + 1].logical;
+        }
+
+        header = get_extent_node(records[i].physical);
+        records = get_node_records(header);
+    }
+
+    int i = find_record(records, header->count, block_num);
+    if(i != -1 && block_num < records[i].logical + records[i].length){
+        *found = records[i];
+        return 1;
+    }
+
+    if(i + 1 < header->count && records[i + 1].logical < hole_end){
+        hole_end = records[i + 1].logical;
+    }
+
+    found->logical = block_num;
+    found->physical = -1;
+    found->length = hole_end - block_num;
+    return 0;
+}
+
+// Worst case number of tree blocks the next insert allocates, one split per
+// level below the root plus one more level if the root itself is full
+static uint32_t get_extent_slack(extent_root_t* root){
+    return root->header.depth + (root->header.count >= INODE_EXTENTS);
+}
+
+// Tree blocks a file keeps back while it has pending blocks, one split per
+// level plus a new level, whether or not the root is full yet
+uint32_t get_extent_reserve(extent_root_t* root){
+    return root->header.depth + 1;
+}
+
+// Moves the upper half of an overflowing node to a new block, `sibling`
+// receives the index record pointing at it
+static int split_extent_node(extent_node_t* node, uint32_t goal, extent_t* sibling){
+    uint32_t run_length;
+    uint32_t block_num = alloc_block_run(goal, 0, 1, &run_length);
+    if(run_length == 0){
+        printf("Error: No free block for extent tree node\n");
+        return -1;
+    }
+
+    extent_node_t right;
+    uint16_t half = node->header.count / 2;
+
+    right.header.depth = node->header.depth;
+    right.header.count = node->header.count - half;
+    memcpy(right.records, &node->records[half], right.header.count * sizeof(extent_t));
+    node->header.count = half;
+
+    write_extent_node(block_num, &right);
+
+    sibling->logical = right.records[0].logical;
+    sibling->physical = block_num;
+    sibling->length = 0;
+    return 0;
+}
+
+static int insert_into_node(extent_node_t* node, extent_t* extent, uint32_t goal){
+    int i = find_record(node->records, node->header.count, extent->logical);
+
+    if(node->header.depth == 0){
+        extent_t *prev = i == -1 ? NULL : &node->records[i];
+        extent_t *next = i + 1 < node->header.count ? &node->records[i + 1] : NULL;
+
+        // Grow a neighbour instead of adding a record where possible
+        if(prev != NULL && is_contiguous(prev, extent)){
+            prev->length += extent->length;
+            if(next != NULL && is_contiguous(prev, next)){
+                prev->length += next->length;
+                remove_record(node, i + 1);
+            }
+            return 0;
+        }
+
+        if(next != NULL && is_contiguous(extent, next)){
+            next->logical = extent->logical;
+            next->physical = extent->physical;
+            next->length += extent->length;
+            return 0;
+        }
+
+        insert_record(node, i + 1, extent);
+        return 0;
+    }
+
+    // Index keys are lower bounds of their subtree
+    if(i == -1){
+        i = 0;
+        node->records[0].logical = extent->logical;
+    }
+
+    extent_node_t child;
+    read_extent_node(node->records[i].physical, &child);
+
+    if(insert_into_node(&child, extent, goal)){
+        return -1;
+    }
+
+    if(child.header.count > EXTENTS_PER_BLOCK){
+        extent_t sibling;
+        if(split_extent_node(&child, goal, &sibling)){
+            return -1;
+        }
+        insert_record(node, i + 1, &sibling);
+    }
+
+    write_extent_node(node->records[i].physical, &child);
+    return 0;
+}
+
+// The root is full, push its records down into a new node
+static int push_down_extent_root(extent_node_t* node, uint32_t goal){
+    uint32_t run_length;
+    uint32_t block_num = alloc_block_run(goal, 0, 1, &run_length);
+    if(run_length == 0){
+        printf("Error: No free block for extent tree node\n");
+        return -1;
+    }
+
+    write_extent_node(block_num, node);
+
+    node->records[0].physical = block_num;
+    node->records[0].length = 0;
+    node->header.count = 1;
+    node->header.depth++;
+    return 0;
+}
+
+// Maps a range that is not mapped yet, tree blocks are allocated near `goal`
+int insert_extent(extent_root_t* root, extent_t* extent, uint32_t goal){
+    // Checked up front so that a split never fails half way
+    if(get_free_block_count() < get_extent_slack(root)){
+        printf("Error: Not enough free blocks for the extent tree\n");
+        return -1;
+    }
+
+    __atomic_add_fetch(&extent_generation, 1, __ATOMIC_RELAXED);
+
+    extent_node_t node;
+    load_extent_root(root, &node);
+
+    if(insert_into_node(&node, extent, goal)){
+        return -1;
+    }
+
+    if(node.header.count > INODE_EXTENTS && push_down_extent_root(&node, goal)){
+        return -1;
+    }
+
+    store_extent_root(root, &node);
+    return 0;
+}
+
+// Unmaps [from, end) below `node` and collects the data and emptied tree
+// blocks in `freed`. Only one record can be cut in two, so a node overflows
+// by one record at most and is split by its parent like on insert
+static int unmap_extent_node(extent_node_t* node, uint32_t from, uint32_t end, uint32_t goal, uint32_t* freed, uint32_t* freed_count){
+    extent_node_t kept;
+    kept.header = node->header;
+    kept.header.count = 0;
+
+    for(int i = 0; i < node->header.count; i++){
+        extent_t record = node->records[i];
+
+        if(node->header.depth == 0){
+            uint32_t record_end = record.logical + record.length;
+            if(record_end <= from || record.logical >= end){
+                kept.records[kept.header.count++] = record;
+                continue;
+            }
+
+            uint32_t cut_start = record.logical > from ? record.logical : from;
+            uint32_t cut_end = record_end < end ? record_end : end;
+            for(uint32_t j = cut_start; j < cut_end; j++){
+                freed[(*freed_count)++] = record.physical + (j - record.logical);
+            }
+
+            if(record.logical < from){
+                extent_t left = {record.logical, record.physical, from - record.logical};
+                kept.records[kept.header.count++] = left;
+            }
+            if(record_end > end){
+                extent_t right = {end, record.physical + (end - record.logical), record_end - end};
+                kept.records[kept.header.count++] = right;
+            }
+            continue;
+        }
+
+        // Subtrees outside the range are left alone
+        if((i + 1 < node->header.count && node->records[i + 1].logical <= from) || record.logical >= end){
+            kept.records[kept.header.count++] = record;
+            continue;
+        }
+
+        extent_node_t child;
+        read_extent_node(record.physical, &child);
+        if(unmap_extent_node(&child, from, end, goal, freed, freed_count)){
+            return -1;
+        }
+
+        if(child.header.count == 0){
+            freed[(*freed_count)++] = record.physical;
+            continue;
+        }
+
+        // Keys stay tight, so a hole punched at the start of a subtree is
+        // filled through the subtree before it rather than across its key
+        record.logical = child.records[0].logical;
+        kept.records[kept.header.count++] = record;
+
+        if(child.header.count > EXTENTS_PER_BLOCK){
+            extent_t sibling;
+            if(split_extent_node(&child, goal, &sibling)){
+                return -1;
+            }
+            kept.records[kept.header.count++] = sibling;
+        }
+
+        write_extent_node(record.physical, &child);
+    }
+
+    node->header = kept.header;
+    memcpy(node->records, kept.records, kept.header.count * sizeof(extent_t));
+    return 0;
+}
+
+// Unmaps [from, end) and frees the data and emptied tree blocks in one batch
+static int unmap_extents(extent_root_t* root, uint32_t from, uint32_t end, uint32_t goal){
+    __atomic_add_fetch(&extent_generation, 1, __ATOMIC_RELAXED);
+
+    extent_node_t node;
+    load_extent_root(root, &node);
+
+    // A file never holds more blocks than the disk
+    uint32_t *freed = malloc(NUM_BLOCKS * sizeof(uint32_t));
+    uint32_t freed_count = 0;
+
+    if(unmap_extent_node(&node, from, end, goal, freed, &freed_count)){
+        free(freed);
+        return -1;
+    }
+
+    if(node.header.count == 0){
+        node.header.depth = 0;
+    }
+
+    if(node.header.count > INODE_EXTENTS && push_down_extent_root(&node, goal)){
+        free(freed);
+        return -1;
+    }
+
+    store_extent_root(root, &node);
+
+    free_block_list(freed, freed_count);
+    free(freed);
+    return 0;
+}
+
+// Unmaps `length` blocks from `from` on, leaving a hole. Cutting an extent
+// in two can split tree nodes, which are allocated near `goal`
+int punch_extents(extent_root_t* root, uint32_t from, uint32_t length, uint32_t goal){
+    // Checked up front so that a split never fails half way
+    if(get_free_block_count() < get_extent_slack(root)){
+        printf("Error: Not enough free blocks for the extent tree\n");
+        return -1;
+    }
+
+    return unmap_extents(root, from, from + length, goal);
+}
+
+// Unmaps every block from logical block `from` on, nothing is cut in two
+// so this never allocates
+void truncate_extents(extent_root_t* root, uint32_t from){
+    unmap_extents(root, from, UINT32_MAX, 0);
+}
@@ -3,37 +3,109 @@
 
 #include "sfs_api.h"
 #include "sfs_block.h"
+#include "sfs_extent.h"
 #include "disk_emu.h"
 
-// INODE - 64 bytes -> 16 per block
+// The i-node table can be anywhere on disk but never outgrows it
+#define MAX_INODES (NUM_BLOCKS * INODES_PER_BLOCK)
+#define INODE_BITMAP_WORDS ((MAX_INODES + 63) / 64)
+
+// Tiny files keep their data in place of the extent map
+#define INODE_INLINE 0x1
+#define INODE_INLINE_SIZE sizeof(extent_root_t)
+
+// INODE - 256 bytes -> 4 per block
 typedef struct _inode_t {
     uint32_t mode;
     uint32_t link_count;
     uint32_t size;
+    uint32_t flags;
 
-    uint32_t direct[INODE_DIRECT_ACCESS];
-    uint32_t indirect;
+    extent_root_t map;
+    byte_t padding[INODE_SIZE - 4*sizeof(uint32_t) - sizeof(extent_root_t)];
 } inode_t;
 
+// Block written to but not yet mapped to a disk address
+typedef struct _delalloc_block_t {
+    uint32_t inode;
+    uint32_t block_num;
+    block_t block;
+} delalloc_block_t;
+
+// Extent tree blocks held back for a file with pending blocks, `failed` is
+// set once writing them back failed
+typedef struct _tree_reserve_t {
+    uint32_t inode;
+    uint32_t blocks;
+    uint32_t failed;
+} tree_reserve_t;
+
+// Last extent or hole looked up in the map of an i-node
+typedef struct _map_cursor_t {
+    uint32_t inode;
+    uint32_t generation;
+    uint32_t mapped;
+    extent_t extent;
+} map_cursor_t;
+
 // I-Node management
 void init_inode_cache();
 
-void write_inode_to_disk(uint32_t inode_num, inode_t* inode);
+void lock_inode(uint32_t inode_num, int exclusive);
+
+void unlock_inode(uint32_t inode_num);
 
 uint32_t get_oldest_inode();
 
 void get_inode(uint32_t inode_num, inode_t* inode);
 
-uint32_t get_next_free_inode();
+void load_inode_bitmap();
+
+uint32_t alloc_inode();
+
+void release_inode(uint32_t inode_num);
 
 void write_inode(inode_t* node, uint32_t index);
 
+void lock_inode_cache();
+
+void unlock_inode_cache();
+
+uint32_t get_free_inode_count();
+
 void flush_inode_cache();
 
-int read_from_inode(inode_t* node, uint32_t offset, uint32_t size, void* buffer);
+uint32_t get_inode_goal(uint32_t inode_index);
+
+uint32_t get_block_pointer(uint32_t inode_index, inode_t* node, uint32_t block_num);
+
+// Delayed allocation
+delalloc_block_t* get_delalloc_block(uint32_t inode_index, uint32_t block_num);
+
+delalloc_block_t* new_delalloc_block(uint32_t inode_index, inode_t* node, uint32_t block_num);
+
+void drop_delalloc_blocks(uint32_t inode_index, uint32_t from);
+
+uint32_t get_reserved_block_count();
+
+int flush_delalloc_inode(uint32_t inode_index, inode_t* node);
+
+int get_writeback_error(uint32_t inode_index);
+
+int flush_delalloc();
+
+int read_from_inode(uint32_t inode_index, inode_t* node, uint32_t offset, uint32_t size, void* buffer);
 
 int write_to_inode(uint32_t, inode_t*, uint32_t, byte_t*, uint32_t);
 
+int seek_inode(uint32_t inode_index, inode_t* node, uint32_t offset, int data);
+
+int preallocate_inode(uint32_t inode_index, inode_t* node, uint32_t offset, uint32_t length);
+
+int truncate_inode(uint32_t inode_index, inode_t* node, uint32_t size);
+
+int clone_inode(uint32_t inode_index, inode_t* node, uint32_t copy_index, inode_t* copy);
+
 void remove_inode(uint32_t);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,333 @@
+/* sfs_test3.c
+ *
+ * Tests cloned files, holes and the positional calls: sfs_clone,
+ * sfs_ftruncate, sfs_fallocate, sfs_fseekdata, sfs_fseekhole,
+ * sfs_fpread and sfs_fpwrite. The disk is remounted along the way to
+ * check what reaches it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define BLOCK_BYTES 1024
+#define FILE_BYTES (20 * BLOCK_BYTES)   /* Size of the file that gets cloned */
+#define INLINE_BYTES 150                /* Small enough to live in the i-node */
+#define SPARSE_BLOCKS 200               /* One extent each, the tree splits */
+#define MANY_FILES 100                  /* Enough to grow the i-node table */
+
+static int error_count = 0;
+
+/* fill() - fill a buffer with a pattern that depends on the offset, so
+ * that misplaced bytes are caught as well as stale ones.
+ */
+static void fill(char *buf, int offset, int length, int seed)
+{
+  int i;
+
+  for (i = 0; i < length; i++) {
+    buf[i] = 'A' + (offset + i + seed * 7) % 26;
+  }
+}
+
+/* check() - read a range of an open file and compare it to `expected`.
+ */
+static void check(int fd, const char *name, int offset, const char *expected, int length)
+{
+  char *buffer = malloc(length);
+  int i, readsize;
+
+  readsize = sfs_fpread(fd, buffer, length, offset);
+  if (readsize != length) {
+    fprintf(stderr, "ERROR: Read %d bytes of %s at %d, expected %d\n",
+            readsize, name, offset, length);
+    error_count++;
+  }
+  else {
+    for (i = 0; i < length; i++) {
+      if (buffer[i] != expected[i]) {
+        fprintf(stderr, "ERROR: Wrong byte in %s at position %d (%d,%d)\n",
+                name, offset + i, buffer[i], expected[i]);
+        error_count++;
+        break;
+      }
+    }
+  }
+  free(buffer);
+}
+
+/* expect() - report a call that returned something other than `wanted`.
+ */
+static void expect(int result, int wanted, const char *what)
+{
+  if (result != wanted) {
+    fprintf(stderr, "ERROR: %s returned %d, expected %d\n", what, result, wanted);
+    error_count++;
+  }
+}
+
+/* The main testing program
+ */
+int
+main(int argc, char **argv)
+{
+  char src[FILE_BYTES];          /* Expected contents of the source file */
+  char copy[FILE_BYTES];         /* Expected contents of its clone */
+  char zeros[4 * BLOCK_BYTES];
+  char buffer[BLOCK_BYTES];
+  char name[16];
+  int fd, fd_copy;
+  int i;
+  int free_empty, free_before, free_inodes;
+
+  mksfs(1);                     /* Initialize the file system. */
+
+  memset(zeros, 0, sizeof(zeros));
+
+  /* The i-node table grows as files are created, so it is grown before
+   * counting the free blocks.
+   */
+  for (i = 0; i < 8; i++) {
+    sprintf(name, "WARMUP%d.DAT", i);
+    sfs_fclose(sfs_fopen(name));
+  }
+  for (i = 0; i < 8; i++) {
+    sprintf(name, "WARMUP%d.DAT", i);
+    sfs_remove(name);
+  }
+  free_empty = sfs_getfreeblocks();
+
+  /* A clone shares the data blocks of its source.
+   */
+  fd = sfs_fopen("SRC.DAT");
+  fill(src, 0, FILE_BYTES, 0);
+  expect(sfs_fwrite(fd, src, FILE_BYTES), FILE_BYTES, "sfs_fwrite of SRC.DAT");
+  sfs_fclose(fd);
+
+  free_before = sfs_getfreeblocks();
+  expect(sfs_clone("SRC.DAT", "COPY.DAT"), 0, "sfs_clone of SRC.DAT");
+  if (free_before - sfs_getfreeblocks() >= FILE_BYTES / BLOCK_BYTES) {
+    fprintf(stderr, "ERROR: Cloning used %d blocks, the data should be shared\n",
+            free_before - sfs_getfreeblocks());
+    error_count++;
+  }
+  expect(sfs_clone("SRC.DAT", "COPY.DAT"), -1, "sfs_clone onto an existing file");
+  expect(sfs_getfilesize("COPY.DAT"), FILE_BYTES, "sfs_getfilesize of COPY.DAT");
+  memcpy(copy, src, FILE_BYTES);
+
+  /* Writing to either copy leaves the other one unchanged, both for a
+   * partial block that gets copied and for whole blocks that do not.
+   */
+  fd_copy = sfs_fopen("COPY.DAT");
+  fill(copy + 1000, 1000, 3000, 1);
+  expect(sfs_fpwrite(fd_copy, copy + 1000, 3000, 1000), 3000, "sfs_fpwrite to COPY.DAT");
+
+  fd = sfs_fopen("SRC.DAT");
+  fill(src + 10 * BLOCK_BYTES, 10 * BLOCK_BYTES, 2 * BLOCK_BYTES, 2);
+  expect(sfs_fpwrite(fd, src + 10 * BLOCK_BYTES, 2 * BLOCK_BYTES, 10 * BLOCK_BYTES),
+         2 * BLOCK_BYTES, "sfs_fpwrite to SRC.DAT");
+
+  check(fd, "SRC.DAT", 0, src, FILE_BYTES);
+  check(fd_copy, "COPY.DAT", 0, copy, FILE_BYTES);
+
+  /* The same after a remount, which reads the share table back
+   */
+  sfs_fclose(fd);
+  sfs_fclose(fd_copy);
+  mksfs(0);
+  fd = sfs_fopen("SRC.DAT");
+  fd_copy = sfs_fopen("COPY.DAT");
+  check(fd, "SRC.DAT", 0, src, FILE_BYTES);
+  check(fd_copy, "COPY.DAT", 0, copy, FILE_BYTES);
+
+  /* Truncating a copy only drops its own mapping of the shared blocks,
+   * and a partial last block is unshared before it is zeroed.
+   */
+  expect(sfs_ftruncate(fd_copy, 5000), 0, "sfs_ftruncate of COPY.DAT");
+  expect(sfs_getfilesize("COPY.DAT"), 5000, "sfs_getfilesize after truncate");
+  check(fd, "SRC.DAT", 0, src, FILE_BYTES);
+  check(fd_copy, "COPY.DAT", 0, copy, 5000);
+
+  expect(sfs_ftruncate(fd_copy, 8 * BLOCK_BYTES), 0, "sfs_ftruncate growing COPY.DAT");
+  check(fd_copy, "COPY.DAT", 0, copy, 5000);
+  check(fd_copy, "COPY.DAT", 5000, zeros, 8 * BLOCK_BYTES - 5000);
+  check(fd, "SRC.DAT", 5000, src + 5000, 8 * BLOCK_BYTES - 5000);
+  sfs_fclose(fd_copy);
+
+  /* Removing one copy must not free the blocks the other still uses
+   */
+  expect(sfs_clone("SRC.DAT", "COPY2.DAT"), 0, "sfs_clone of SRC.DAT");
+  sfs_fclose(fd);
+  free_before = sfs_getfreeblocks();
+  if (sfs_remove("SRC.DAT") == -1) {
+    fprintf(stderr, "ERROR: sfs_remove of SRC.DAT failed\n");
+    error_count++;
+  }
+  if (sfs_getfreeblocks() - free_before > 2) {
+    fprintf(stderr, "ERROR: Removing a cloned file freed %d blocks\n",
+            sfs_getfreeblocks() - free_before);
+    error_count++;
+  }
+
+  fill(buffer, 0, BLOCK_BYTES, 3);      /* Reuse any block freed by mistake */
+  fd = sfs_fopen("FILLER.DAT");
+  expect(sfs_fwrite(fd, buffer, BLOCK_BYTES), BLOCK_BYTES, "sfs_fwrite of FILLER.DAT");
+  sfs_fclose(fd);
+
+  mksfs(0);
+  fd = sfs_fopen("COPY2.DAT");
+  check(fd, "COPY2.DAT", 0, src, FILE_BYTES);
+
+  /* Punching the shared blocks out of the last copy by writing whole
+   * blocks over them
+   */
+  fill(src, 0, 4 * BLOCK_BYTES, 4);
+  expect(sfs_fpwrite(fd, src, 4 * BLOCK_BYTES, 0), 4 * BLOCK_BYTES, "sfs_fpwrite to COPY2.DAT");
+  check(fd, "COPY2.DAT", 0, src, FILE_BYTES);
+  sfs_fclose(fd);
+
+  sfs_remove("COPY.DAT");
+  sfs_remove("COPY2.DAT");
+  sfs_remove("FILLER.DAT");
+  if (sfs_getfreeblocks() < free_empty - 2) {
+    fprintf(stderr, "ERROR: %d blocks still used after removing every clone\n",
+            free_empty - sfs_getfreeblocks());
+    error_count++;
+  }
+
+  /* Holes are skipped by sfs_fseekdata and found by sfs_fseekhole, while
+   * the data is pending, once it is on disk and after a remount.
+   */
+  fd = sfs_fopen("HOLES.DAT");
+  fill(buffer, 0, 100, 5);
+  expect(sfs_fpwrite(fd, buffer, 100, 0), 100, "sfs_fpwrite at 0");
+  expect(sfs_fpwrite(fd, buffer, 100, 8 * BLOCK_BYTES), 100, "sfs_fpwrite at 8 KiB");
+  expect(sfs_ftruncate(fd, 16 * BLOCK_BYTES), 0, "sfs_ftruncate of HOLES.DAT");
+
+  for (int pass = 0; pass < 3; pass++) {
+    expect(sfs_fseekdata(fd, 0), 0, "sfs_fseekdata at 0");
+    expect(sfs_fseekhole(fd, 0), BLOCK_BYTES, "sfs_fseekhole at 0");
+    expect(sfs_fseekdata(fd, BLOCK_BYTES), 8 * BLOCK_BYTES, "sfs_fseekdata in the first hole");
+    expect(sfs_fseekdata(fd, 8 * BLOCK_BYTES + 50), 8 * BLOCK_BYTES + 50, "sfs_fseekdata in data");
+    expect(sfs_fseekhole(fd, 8 * BLOCK_BYTES), 9 * BLOCK_BYTES, "sfs_fseekhole after the data");
+    expect(sfs_fseekdata(fd, 9 * BLOCK_BYTES), -1, "sfs_fseekdata in the last hole");
+    expect(sfs_fseekhole(fd, 12 * BLOCK_BYTES), 12 * BLOCK_BYTES, "sfs_fseekhole in the last hole");
+    expect(sfs_fseekhole(fd, 16 * BLOCK_BYTES), -1, "sfs_fseekhole at the end of file");
+
+    check(fd, "HOLES.DAT", BLOCK_BYTES, zeros, 4 * BLOCK_BYTES);
+    check(fd, "HOLES.DAT", 8 * BLOCK_BYTES, buffer, 100);
+    check(fd, "HOLES.DAT", 8 * BLOCK_BYTES + 100, zeros, BLOCK_BYTES);
+
+    sfs_fclose(fd);
+    if (pass == 1) {
+      mksfs(0);
+    }
+    fd = sfs_fopen("HOLES.DAT");
+  }
+
+  /* Preallocated blocks are counted as used but the size does not change,
+   * and they read as zeros until written.
+   */
+  free_before = sfs_getfreeblocks();
+  expect(sfs_fallocate(fd, 2 * BLOCK_BYTES, 4 * BLOCK_BYTES), 0, "sfs_fallocate in a hole");
+  expect(sfs_fallocate(fd, 16 * BLOCK_BYTES, 4 * BLOCK_BYTES), 0, "sfs_fallocate past the end");
+  if (free_before - sfs_getfreeblocks() < 8) {
+    fprintf(stderr, "ERROR: Preallocating 8 blocks used only %d\n",
+            free_before - sfs_getfreeblocks());
+    error_count++;
+  }
+  expect(sfs_getfilesize("HOLES.DAT"), 16 * BLOCK_BYTES, "sfs_getfilesize after fallocate");
+  check(fd, "HOLES.DAT", 2 * BLOCK_BYTES, zeros, 4 * BLOCK_BYTES);
+
+  free_before = sfs_getfreeblocks();
+  expect(sfs_fpwrite(fd, buffer, 100, 3 * BLOCK_BYTES), 100, "sfs_fpwrite to preallocated blocks");
+  expect(sfs_ftruncate(fd, 20 * BLOCK_BYTES), 0, "sfs_ftruncate over preallocated blocks");
+  if (sfs_getfreeblocks() != free_before) {
+    fprintf(stderr, "ERROR: Writing preallocated blocks used %d more\n",
+            free_before - sfs_getfreeblocks());
+    error_count++;
+  }
+  check(fd, "HOLES.DAT", 3 * BLOCK_BYTES, buffer, 100);
+  check(fd, "HOLES.DAT", 16 * BLOCK_BYTES, zeros, 4 * BLOCK_BYTES);
+
+  /* sfs_fpread and sfs_fpwrite leave the file position alone
+   */
+  sfs_fseek(fd, 0);
+  expect(sfs_fpwrite(fd, buffer, 100, 12 * BLOCK_BYTES), 100, "sfs_fpwrite at 12 KiB");
+  check(fd, "HOLES.DAT", 12 * BLOCK_BYTES, buffer, 100);
+  expect(sfs_fread(fd, src, 100), 100, "sfs_fread after sfs_fpwrite");
+  if (memcmp(src, buffer, 100) != 0) {
+    fprintf(stderr, "ERROR: sfs_fread did not start at the file position\n");
+    error_count++;
+  }
+  expect(sfs_fpread(fd, buffer, 100, 20 * BLOCK_BYTES), 0, "sfs_fpread at the end of file");
+
+  sfs_fclose(fd);
+  sfs_remove("HOLES.DAT");
+
+  /* Inline files, a file whose extent tree splits and enough files to
+   * grow the i-node table all read back the same after a remount.
+   */
+  fd = sfs_fopen("INLINE.DAT");
+  fill(buffer, 0, INLINE_BYTES, 6);
+  expect(sfs_fwrite(fd, buffer, INLINE_BYTES), INLINE_BYTES, "sfs_fwrite of INLINE.DAT");
+  sfs_fclose(fd);
+  expect(sfs_clone("INLINE.DAT", "INLINE2.DAT"), 0, "sfs_clone of INLINE.DAT");
+
+  fd = sfs_fopen("SPARSE.DAT");
+  for (i = 0; i < SPARSE_BLOCKS; i++) {
+    fill(buffer, 2 * i * BLOCK_BYTES, BLOCK_BYTES, 7);
+    expect(sfs_fpwrite(fd, buffer, BLOCK_BYTES, 2 * i * BLOCK_BYTES), BLOCK_BYTES,
+           "sfs_fpwrite to SPARSE.DAT");
+  }
+  sfs_fclose(fd);
+
+  for (i = 0; i < MANY_FILES; i++) {
+    sprintf(name, "MANY%d.DAT", i);
+    fd = sfs_fopen(name);
+    expect(sfs_fwrite(fd, name, strlen(name)), strlen(name), "sfs_fwrite of a small file");
+    sfs_fclose(fd);
+  }
+
+  free_before = sfs_getfreeblocks();
+  free_inodes = sfs_getfreeinodes();
+  mksfs(0);
+  expect(sfs_getfreeblocks(), free_before, "sfs_getfreeblocks after a remount");
+  expect(sfs_getfreeinodes(), free_inodes, "sfs_getfreeinodes after a remount");
+
+  fill(buffer, 0, INLINE_BYTES, 6);
+  expect(sfs_getfilesize("INLINE.DAT"), INLINE_BYTES, "sfs_getfilesize of INLINE.DAT");
+  fd = sfs_fopen("INLINE.DAT");
+  check(fd, "INLINE.DAT", 0, buffer, INLINE_BYTES);
+  sfs_fclose(fd);
+  fd = sfs_fopen("INLINE2.DAT");
+  check(fd, "INLINE2.DAT", 0, buffer, INLINE_BYTES);
+  sfs_fclose(fd);
+
+  fd = sfs_fopen("SPARSE.DAT");
+  for (i = 0; i < SPARSE_BLOCKS; i++) {
+    fill(buffer, 2 * i * BLOCK_BYTES, BLOCK_BYTES, 7);
+    check(fd, "SPARSE.DAT", 2 * i * BLOCK_BYTES, buffer, BLOCK_BYTES);
+    expect(sfs_fseekhole(fd, 2 * i * BLOCK_BYTES), (2 * i + 1) * BLOCK_BYTES,
+           "sfs_fseekhole in SPARSE.DAT");
+    if (i < SPARSE_BLOCKS - 1) {
+      check(fd, "SPARSE.DAT", (2 * i + 1) * BLOCK_BYTES, zeros, BLOCK_BYTES);
+    }
+  }
+  sfs_fclose(fd);
+
+  for (i = 0; i < MANY_FILES; i++) {
+    sprintf(name, "MANY%d.DAT", i);
+    fd = sfs_fopen(name);
+    check(fd, name, 0, name, strlen(name));
+    sfs_fclose(fd);
+    sfs_remove(name);
+  }
+  sfs_remove("INLINE.DAT");
+  sfs_remove("INLINE2.DAT");
+  sfs_remove("SPARSE.DAT");
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -1,8 +1,16 @@
 #ifndef SFS_BLOCK_H
 #define SFS_BLOCK_H
 
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
+#include "sfs_extent.h"
+
+#define BITMAP_WORDS ((NUM_BLOCKS + 63) / 64)
+#define SUMMARY_WORDS ((BITMAP_WORDS + 63) / 64)
+#define WORDS_PER_BITMAP_BLOCK (BLOCK_SIZE * 8 / 64)
+#define SHARES_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+#define MAX_BLOCK_SHARES UINT16_MAX
 
 // Fixed size of 1024 bytes
 typedef struct _block_t{
@@ -10,6 +18,12 @@ typedef struct _block_t{
 } block_t;
 
 
+// Allocation group descriptor, kept in the superblock
+typedef struct _group_desc_t {
+    uint32_t free_block_count;
+    uint32_t first_free_hint;
+} group_desc_t;
+
 // Superblock representation (fixed at 1024 byte for ease of use)
 typedef struct _superblock_t {
     uint32_t magic;
@@ -17,11 +31,21 @@ typedef struct _superblock_t {
     uint32_t file_system_size;
     uint32_t inode_table_length;
     uint32_t root_dir_inode;
-    byte_t padding[BLOCK_SIZE - 5*sizeof(uint32_t)];
+    uint32_t free_block_count;
+    uint32_t free_inode_count;
+    uint32_t free_inode_hint;
+    // I-node table blocks from this one on were never written and hold no i-nodes
+    uint32_t inode_table_initialized;
+    group_desc_t groups[NUM_GROUPS];
+    // The i-node table is a file of its own, `inode_table_length` blocks long
+    extent_root_t inode_table_map;
+    byte_t padding[BLOCK_SIZE - 9*sizeof(uint32_t) - NUM_GROUPS*sizeof(group_desc_t) - sizeof(extent_root_t)];
 } superblock_t;
 
 superblock_t* get_superblock();
 
+void init_recursive_lock(pthread_mutex_t* lock);
+
 // Block cache management
 void init_block_cache();
 
@@ -31,11 +55,61 @@ void _write_block(uint32_t block_num, block_t* block);
 
 void _read_block(uint32_t block_num, block_t* block);
 
+void drop_cached_blocks(uint32_t start, uint32_t length);
+
+int is_block_cached(uint32_t block_num);
+
+void read_block_run(uint32_t start, uint32_t length, void* buffer);
+
+void write_block_run(uint32_t start, uint32_t length, void* buffer);
+
+// Metadata partition management (superblock, free bitmap, i-node table)
+block_t* get_meta_block(uint32_t block_num);
+
+block_t* new_meta_block(uint32_t block_num);
+
+void mark_meta_block_dirty(uint32_t block_num);
+
+void _read_meta_block(uint32_t block_num, block_t* block);
+
+void _write_meta_block(uint32_t block_num, block_t* block);
+
+void flush_meta_cache();
+
+// Free bitmap management
+void load_free_bitmap();
+
+void sync_free_bitmap(superblock_t* snapshot);
+
+void rebuild_free_summary();
+
+// Allocation groups
+uint32_t get_group_start(uint32_t group);
+
+uint32_t get_group_end(uint32_t group);
+
+uint32_t get_group_free_count(uint32_t group);
+
+uint32_t get_group_goal(uint32_t group);
+
+uint32_t get_free_block_count();
+
 int is_block_free(uint32_t block_num);
 
 void set_block_status(uint32_t block_num, int status);
 
-uint32_t get_next_free_block();
+void set_block_run_status(uint32_t start, uint32_t length, int status);
+
+void free_block_list(uint32_t* blocks, uint32_t count);
+
+// Block sharing
+uint32_t get_share_table_start();
+
+uint32_t get_block_shares(uint32_t block_num);
+
+int share_block_run(uint32_t start, uint32_t length);
+
+uint32_t alloc_block_run(uint32_t goal, int extend, uint32_t count, uint32_t* length);
 
 void flush_block_cache();
 
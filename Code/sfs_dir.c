@@ -12,6 +12,38 @@
 
 dir_entry_t *dir_table;
 int dir_table_size;
+int dir_table_capacity;
+
+// Name index over the table, entries of a bucket are chained through `dir_hash_next`
+int dir_hash_head[DIR_HASH_SIZE];
+int *dir_hash_next;
+
+// FNV-1a
+static uint32_t hash_name(const char* name){
+    uint32_t hash = 2166136261u;
+    for(; *name != '\0'; name++){
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    }
+
+    return hash % DIR_HASH_SIZE;
+}
+
+static void hash_dir_entry(int i){
+    uint32_t bucket = hash_name(dir_table[i].filename);
+
+    dir_hash_next[i] = dir_hash_head[bucket];
+    dir_hash_head[bucket] = i;
+}
+
+static void unhash_dir_entry(int i){
+    int *link = &dir_hash_head[hash_name(dir_table[i].filename)];
+
+    while(*link != i){
+        link = &dir_hash_next[*link];
+    }
+    *link = dir_hash_next[i];
+    dir_hash_next[i] = -1;
+}
 
 void read_dir_table(){
     inode_t root_node;
@@ -22,8 +54,35 @@ void read_dir_table(){
         free(dir_table);
     }
 
-    dir_table = calloc(dir_table_size, sizeof(dir_entry_t));
-    read_from_inode(&root_node, 0, root_node.size, dir_table);
+    // Room for at least one block of entries
+    dir_table_capacity = dir_table_size > DIR_ENTRIES_PER_BLOCK ? dir_table_size : DIR_ENTRIES_PER_BLOCK;
+    dir_table = calloc(dir_table_capacity, sizeof(dir_entry_t));
+    read_from_inode(get_superblock()->root_dir_inode, &root_node, 0, root_node.size, dir_table);
+
+    free(dir_hash_next);
+    dir_hash_next = malloc(dir_table_capacity * sizeof(int));
+
+    for(int i = 0; i < DIR_HASH_SIZE; i++){
+        dir_hash_head[i] = -1;
+    }
+
+    for(int i = 0; i < dir_table_size; i++){
+        dir_hash_next[i] = -1;
+        if(dir_table[i].valid){
+            hash_dir_entry(i);
+        }
+    }
+}
+
+// Index of the entry named `name`, or -1
+int find_dir_table_entry(const char* name){
+    for(int i = dir_hash_head[hash_name(name)]; i != -1; i = dir_hash_next[i]){
+        if(strcmp(name, dir_table[i].filename) == 0){
+            return i;
+        }
+    }
+
+    return -1;
 }
 
 dir_entry_t* get_dir_table_entry(int i){
@@ -37,11 +96,16 @@ int get_dir_table_size(){
     return dir_table_size;
 }
 
-void write_dir_table(){
+// Writes entry `i` back, only the directory block holding it changes
+static void write_dir_entry(int i){
+    uint32_t root = get_superblock()->root_dir_inode;
+
     inode_t root_node;
-    get_inode(get_superblock()->root_dir_inode, &root_node);
+    lock_inode(root, 1);
+    get_inode(root, &root_node);
 
-    write_to_inode(get_superblock()->root_dir_inode, &root_node, 0, (byte_t *) dir_table, dir_table_size * sizeof(dir_entry_t));
+    write_to_inode(root, &root_node, i * sizeof(dir_entry_t), (byte_t *) (dir_table + i), sizeof(dir_entry_t));
+    unlock_inode(root);
 }
 
 void write_to_dir_table(int i, dir_entry_t *entry){
@@ -50,21 +114,34 @@ void write_to_dir_table(int i, dir_entry_t *entry){
     }
 
     if(i >= dir_table_size){
+        // Doubling keeps the copying constant per entry on average
+        if(i >= dir_table_capacity){
+            while(i >= dir_table_capacity){
+                dir_table_capacity *= 2;
+            }
+            dir_table = realloc(dir_table, dir_table_capacity * sizeof(dir_entry_t));
+            dir_hash_next = realloc(dir_hash_next, dir_table_capacity * sizeof(int));
+        }
+
+        for(int j = dir_table_size; j <= i; j++){
+            memset(dir_table + j, 0, sizeof(dir_entry_t));
+            dir_hash_next[j] = -1;
+        }
         dir_table_size = i + 1;
-        dir_table = realloc(dir_table, dir_table_size * sizeof(dir_entry_t));
+    } else if(dir_table[i].valid){
+        unhash_dir_entry(i);
     }
 
     memcpy(dir_table + i, entry, sizeof(dir_entry_t));
+    if(entry->valid){
+        hash_dir_entry(i);
+    }
 
-    write_dir_table();
+    write_dir_entry(i);
 }
 
+// Removal keeps the table compact, so the only free slot is past the end
 int get_free_dir_table_entry(){
-    for(int i = 0; i < dir_table_size; i++){
-        if(dir_table[i].inode == 0){
-            return i;
-        }
-    }
     return dir_table_size;
 }
 
@@ -73,30 +150,39 @@ int remove_from_dir_table(int i){
         return -1;
     }
 
-    dir_table[i].valid = 0;
     int n = dir_table[i].inode;
-
-    dir_entry_t* tmp = calloc(dir_table_size - 1, sizeof(dir_entry_t));
-    for(int j = 0; j < i; j++){
-        memcpy(tmp + j, dir_table + j, sizeof(dir_entry_t));
+    if(dir_table[i].valid){
+        unhash_dir_entry(i);
     }
 
-    for(int j = i + 1; j < dir_table_size; j++){
-        memcpy(tmp + j - 1, dir_table + j, sizeof(dir_entry_t));
-    }
+    // The last entry fills the gap, so no other entry moves
+    int last = dir_table_size - 1;
+    if(i != last){
+        if(dir_table[last].valid){
+            unhash_dir_entry(last);
+        }
 
-    free(dir_table);
-    dir_table = tmp;
+        memcpy(dir_table + i, dir_table + last, sizeof(dir_entry_t));
+        if(dir_table[i].valid){
+            hash_dir_entry(i);
+        }
+    }
 
     dir_table_size--;
 
-    inode_t root_node;
-    get_inode(get_superblock()->root_dir_inode , &root_node);
+    if(i != last){
+        write_dir_entry(i);
+    }
 
-    root_node.size -= sizeof(dir_entry_t);
-    write_inode(&root_node, get_superblock()->root_dir_inode);
+    // Dropping the last slot frees the tail block once it empties
+    uint32_t root = get_superblock()->root_dir_inode;
+
+    inode_t root_node;
+    lock_inode(root, 1);
+    get_inode(root, &root_node);
 
-    write_dir_table();
+    truncate_inode(root, &root_node, dir_table_size * sizeof(dir_entry_t));
+    unlock_inode(root);
 
     return n;
 }
\ No newline at end of file
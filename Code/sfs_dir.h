@@ -12,6 +12,8 @@ void read_dir_table();
 
 dir_entry_t* get_dir_table_entry(int);
 
+int find_dir_table_entry(const char*);
+
 int get_dir_table_size();
 
 void write_to_dir_table(int, dir_entry_t*);
@@ -0,0 +1,44 @@
+#ifndef SFS_EXTENT_H
+#define SFS_EXTENT_H
+
+#include "sfs_api.h"
+
+// EXTENT - 12 bytes, maps `length` logical blocks starting at `logical` onto
+// consecutive disk blocks starting at `physical`. Index records use
+// `physical` for the child node and leave `length` at 0
+typedef struct _extent_t {
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t length;
+} extent_t;
+
+// Tree node header, depth 0 nodes hold extents, deeper ones index records
+typedef struct _extent_header_t {
+    uint16_t count;
+    uint16_t depth;
+} extent_header_t;
+
+// Root of the extent tree, kept in the i-node - 232 bytes
+typedef struct _extent_root_t {
+    extent_header_t header;
+    extent_t extents[INODE_EXTENTS];
+} extent_root_t;
+
+// Records in a tree node block
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t))
+
+uint32_t get_extent_generation();
+
+uint32_t get_extent_reserve(extent_root_t* root);
+
+void init_extent_root(extent_root_t* root);
+
+int find_extent(extent_root_t* root, uint32_t block_num, extent_t* found);
+
+int insert_extent(extent_root_t* root, extent_t* extent, uint32_t goal);
+
+int punch_extents(extent_root_t* root, uint32_t from, uint32_t length, uint32_t goal);
+
+void truncate_extents(extent_root_t* root, uint32_t from);
+
+#endif
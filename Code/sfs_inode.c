@@ -5,46 +5,219 @@
 #include <stdint.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include "sfs_api.h"
 #include "sfs_inode.h"
 #include "sfs_block.h"
 #include "disk_emu.h"
 
-// Inode Cache
+// Inode Cache, chained hash on i-node number, dirty entries are written back per table block
 inode_t inode_cache[INODE_CACHE_SIZE];
 uint32_t inode_cache_index[INODE_CACHE_SIZE];
 uint16_t inode_cache_age[INODE_CACHE_SIZE];
+uint8_t inode_cache_dirty[INODE_CACHE_SIZE];
+int16_t inode_cache_next[INODE_CACHE_SIZE];
+int16_t inode_hash_head[INODE_HASH_SIZE];
 uint16_t inode_rolling_counter = 1;
 
+// In-memory i-node bitmap, bit set means the i-node is in use
+uint64_t inode_bitmap[INODE_BITMAP_WORDS];
+
+// Group the next new file goes to, files are spread over the groups in turn
+uint32_t next_inode_group = 0;
+
+// Map cursors of the i-nodes looked up last in each thread, so sequential
+// access walks the extent tree once per extent rather than once per block.
+// Any i-node may take any cursor, there are enough for every open file
+__thread map_cursor_t map_cursor[MAX_OPEN_FILES];
+__thread uint32_t map_cursor_last;
+__thread uint32_t map_cursor_victim;
+
+// I-node locks, striped over the i-node numbers. Shared while a file is
+// read, exclusive while it or its i-node changes
+pthread_rwlock_t inode_lock[INODE_LOCK_COUNT];
+
+// Guards the i-node cache, the i-node bitmap and the table size
+pthread_mutex_t inode_cache_lock;
+
+// Guards the delayed allocation pool
+pthread_mutex_t delalloc_lock;
+
+// Delayed allocation pool, blocks written but not yet given a disk address
+delalloc_block_t delalloc_pool[DELALLOC_MAX_BLOCKS];
+int delalloc_count = 0;
+uint32_t reserved_block_count = 0;
+
+// Mapping pending blocks can split the extent tree, each file with pending
+// blocks keeps the tree blocks for that in `reserved_block_count` too
+tree_reserve_t tree_reserve[DELALLOC_MAX_BLOCKS];
+
 // I-Node management
 void init_inode_cache(){
     for(int i = 0; i < INODE_CACHE_SIZE; i++){
         inode_cache_index[i] = -1;
+        inode_cache_dirty[i] = 0;
+        inode_cache_next[i] = -1;
+    }
+
+    for(int i = 0; i < INODE_HASH_SIZE; i++){
+        inode_hash_head[i] = -1;
+    }
+
+    memset(inode_bitmap, 0, sizeof(inode_bitmap));
+    next_inode_group = 0;
+
+    for(int i = 0; i < MAX_OPEN_FILES; i++){
+        map_cursor[i].inode = -1;
+    }
+
+    for(int i = 0; i < DELALLOC_MAX_BLOCKS; i++){
+        delalloc_pool[i].inode = -1;
+        tree_reserve[i].inode = -1;
+    }
+    delalloc_count = 0;
+    reserved_block_count = 0;
+
+    for(int i = 0; i < INODE_LOCK_COUNT; i++){
+        pthread_rwlock_init(&inode_lock[i], NULL);
+    }
+    init_recursive_lock(&inode_cache_lock);
+    init_recursive_lock(&delalloc_lock);
+}
+
+void lock_inode(uint32_t inode_num, int exclusive){
+    if(exclusive){
+        pthread_rwlock_wrlock(&inode_lock[inode_num % INODE_LOCK_COUNT]);
+    } else {
+        pthread_rwlock_rdlock(&inode_lock[inode_num % INODE_LOCK_COUNT]);
     }
 }
 
-void write_inode_to_disk(uint32_t inode_num, inode_t* inode){
-    uint32_t block_num = inode_num / INODES_PER_BLOCK;
+static int try_lock_inode(uint32_t inode_num){
+    return pthread_rwlock_trywrlock(&inode_lock[inode_num % INODE_LOCK_COUNT]);
+}
 
-    if(block_num > get_superblock()->inode_table_length){
-        if(is_block_free(block_num)){
-            set_block_status(block_num, 1);
-            get_superblock()->inode_table_length++;
-            _write_block(0, (block_t*)get_superblock());
-        } else {
-            printf("Error: Block %d is not free, failed contiguous allocation of i-node table\n", block_num);
-            exit(1);
+void unlock_inode(uint32_t inode_num){
+    pthread_rwlock_unlock(&inode_lock[inode_num % INODE_LOCK_COUNT]);
+}
+
+// Disk block holding i-node table block `table_block`, -1 for a block the
+// table does not have
+static uint32_t get_inode_table_block(uint32_t table_block){
+    extent_t extent;
+    if(table_block >= get_superblock()->inode_table_length
+        || !find_extent(&get_superblock()->inode_table_map, table_block, &extent)){
+        printf("Error: I-node table block %u is not mapped\n", table_block);
+        return -1;
+    }
+
+    return extent.physical + (table_block - extent.logical);
+}
+
+// Adds up to a chunk of blocks to the end of the i-node table, placed in
+// `group` where possible but anywhere on disk otherwise. The new blocks
+// are left uninitialized until an i-node in them is written back
+static int grow_inode_table(uint32_t group){
+    superblock_t *superblock = get_superblock();
+
+    // Blocks promised to delayed writes and the extent tree are left alone
+    uint32_t unavailable = get_reserved_block_count() + EXTENT_RESERVE_BLOCKS;
+    uint32_t count = INODE_TABLE_CHUNK;
+    uint32_t free_count = get_free_block_count();
+    if(free_count < unavailable + count){
+        count = free_count > unavailable ? free_count - unavailable : 0;
+    }
+
+    uint32_t goal = get_group_goal(group);
+    int extend = 0;
+
+    uint32_t added = 0;
+    while(added < count){
+        uint32_t run_length;
+        uint32_t run_start = alloc_block_run(goal, extend, count - added, &run_length);
+        if(run_length == 0){
+            break;
+        }
+
+        extent_t extent = {superblock->inode_table_length, run_start, run_length};
+        if(insert_extent(&superblock->inode_table_map, &extent, run_start)){
+            set_block_run_status(run_start, run_length, 0);
+            break;
+        }
+
+        superblock->inode_table_length += run_length;
+        superblock->free_inode_count += run_length * INODES_PER_BLOCK;
+
+        added += run_length;
+        goal = run_start + run_length;
+        extend = 1;
+    }
+
+    if(added == 0){
+        printf("Error: No free block to grow the i-node table\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int find_cached_inode(uint32_t inode_num){
+    for(int i = inode_hash_head[inode_num % INODE_HASH_SIZE]; i != -1; i = inode_cache_next[i]){
+        if(inode_cache_index[i] == inode_num){
+            return i;
         }
     }
 
-    block_t block;
-    _read_block(block_num + 1, &block);
+    return -1;
+}
+
+static void unhash_cached_inode(int slot){
+    int16_t *link = &inode_hash_head[inode_cache_index[slot] % INODE_HASH_SIZE];
 
-    memcpy(block.data + (inode_num % INODES_PER_BLOCK) * sizeof(inode_t), inode, sizeof(inode_t));
+    while(*link != slot){
+        link = &inode_cache_next[*link];
+    }
+    *link = inode_cache_next[slot];
+    inode_cache_next[slot] = -1;
+}
 
-    _write_block(block_num + 1, &block);
+static void hash_cached_inode(int slot, uint32_t inode_num){
+    uint32_t bucket = inode_num % INODE_HASH_SIZE;
+
+    inode_cache_index[slot] = inode_num;
+    inode_cache_next[slot] = inode_hash_head[bucket];
+    inode_hash_head[bucket] = slot;
 }
 
+// Copies every dirty cached i-node of one table block in, so the block is dirtied once
+static void write_back_inode_block(uint32_t table_block){
+    superblock_t *superblock = get_superblock();
+
+    // Reused blocks may hold stale data, so uninitialized table blocks up to
+    // this one are zeroed in memory rather than read
+    uint32_t block_num = get_inode_table_block(table_block);
+    if(block_num == -1){
+        return;
+    }
+
+    while(superblock->inode_table_initialized <= table_block){
+        new_meta_block(get_inode_table_block(superblock->inode_table_initialized++));
+    }
+
+    block_t *block = get_meta_block(block_num);
+
+    for(int i = 0; i < INODE_CACHE_SIZE; i++){
+        if(inode_cache_dirty[i] && inode_cache_index[i] / INODES_PER_BLOCK == table_block){
+            memcpy(block->data + (inode_cache_index[i] % INODES_PER_BLOCK) * sizeof(inode_t), &inode_cache[i], sizeof(inode_t));
+            inode_cache_dirty[i] = 0;
+        }
+    }
+
+    mark_meta_block_dirty(block_num);
+}
+
+// Called with the i-node cache locked
 uint32_t get_oldest_inode(){
     uint32_t oldest_index = 0;
     for(int i = 0; i < INODE_CACHE_SIZE; i++){
@@ -56,121 +229,666 @@ uint32_t get_oldest_inode(){
         }
     }
 
-    uint32_t inode_block_num = inode_cache_index[oldest_index] / INODES_PER_BLOCK;
-
-    for(int i = 0; i < INODE_CACHE_SIZE; i++){
-        if(inode_cache_index[i] / INODES_PER_BLOCK == inode_block_num){
-            write_inode_to_disk(inode_cache_index[i], &inode_cache[i]);
-        }
+    if(inode_cache_dirty[oldest_index]){
+        write_back_inode_block(inode_cache_index[oldest_index] / INODES_PER_BLOCK);
     }
 
+    unhash_cached_inode(oldest_index);
+    inode_cache_index[oldest_index] = -1;
+
     inode_rolling_counter++;
     return oldest_index;
 }
 
 void get_inode(uint32_t inode_num, inode_t *inode){
-    for(int i = 0; i < INODE_CACHE_SIZE; i++){
-        if(inode_cache_index[i] == inode_num){
-            inode_cache_age[i] = inode_rolling_counter;
-            memcpy(inode, &(inode_cache[i]), sizeof(inode_t));
-            return;
-        }
-    }
+    pthread_mutex_lock(&inode_cache_lock);
 
-    unsigned int oldest = get_oldest_inode();
+    int cached = find_cached_inode(inode_num);
 
-    if(oldest == -1){
-        printf("Error: Failed to find oldest inode in cache\n");
-        exit(1);
+    if(cached != -1){
+        inode_cache_age[cached] = inode_rolling_counter;
+        memcpy(inode, &(inode_cache[cached]), sizeof(inode_t));
+        pthread_mutex_unlock(&inode_cache_lock);
+        return;
     }
 
+    unsigned int oldest = get_oldest_inode();
+
     uint32_t inode_block_num = inode_num / INODES_PER_BLOCK;
 
-    block_t block;
-    _read_block(inode_block_num + 1, &block);
+    uint32_t block_num = -1;
+    if(inode_block_num < get_superblock()->inode_table_initialized){
+        block_num = get_inode_table_block(inode_block_num);
+    }
 
-    memcpy(&inode_cache[oldest], block.data + (inode_num % INODES_PER_BLOCK) * sizeof(inode_t), sizeof(inode_t));
-    memcpy(inode, block.data + (inode_num % INODES_PER_BLOCK) * sizeof(inode_t), sizeof(inode_t));
-    inode_cache_index[oldest] = inode_num;
+    if(block_num != -1){
+        block_t *block = get_meta_block(block_num);
+        memcpy(&inode_cache[oldest], block->data + (inode_num % INODES_PER_BLOCK) * sizeof(inode_t), sizeof(inode_t));
+    } else {
+        memset(&inode_cache[oldest], 0, sizeof(inode_t));
+    }
+    memcpy(inode, &inode_cache[oldest], sizeof(inode_t));
+    hash_cached_inode(oldest, inode_num);
+    inode_cache_dirty[oldest] = 0;
     inode_cache_age[oldest] = inode_rolling_counter;
 
     inode_rolling_counter++;
+    pthread_mutex_unlock(&inode_cache_lock);
 }
 
-uint32_t get_next_free_inode(){
-    for(int i = 0; i < get_superblock()->inode_table_length; i++){
-        block_t block;
-        _read_block(i + 1, &block);
+// Marks every i-node with a link as used, the table is only scanned once per mount
+void load_inode_bitmap(){
+    superblock_t *superblock = get_superblock();
+
+    memset(inode_bitmap, 0, sizeof(inode_bitmap));
+
+    // Uninitialized table blocks are not read, all their i-nodes are free
+    superblock->free_inode_count = (superblock->inode_table_length - superblock->inode_table_initialized) * INODES_PER_BLOCK;
+
+    for(int i = 0; i < superblock->inode_table_initialized; i++){
+        uint32_t block_num = get_inode_table_block(i);
+        if(block_num == -1){
+            break;
+        }
+        block_t *block = get_meta_block(block_num);
 
         for(int j = 0; j < INODES_PER_BLOCK; j++){
-            inode_t* inode = (inode_t*)(block.data + j * sizeof(inode_t));
+            inode_t* inode = (inode_t*)(block->data + j * sizeof(inode_t));
+            uint32_t inode_num = i * INODES_PER_BLOCK + j;
+
             if(inode->link_count == 0){
-                return i * INODES_PER_BLOCK + j;
+                superblock->free_inode_count++;
+            }else{
+                inode_bitmap[inode_num / 64] |= 1ULL << (inode_num % 64);
             }
         }
     }
 
-    return get_superblock()->inode_table_length * INODES_PER_BLOCK + 1;
+    if(superblock->free_inode_hint > superblock->inode_table_length * INODES_PER_BLOCK){
+        superblock->free_inode_hint = 0;
+    }
 }
 
-void write_inode(inode_t* node, uint32_t index){
-    uint32_t block_num = index / INODES_PER_BLOCK;
-    if(block_num > get_superblock()->inode_table_length){
-        /*if(block_num + 1 != get_superblock()->inode_table_length){
-            printf("Error: Failed contiguous allocation of i-node table\n");
-            return;
-        }*/
-        if(is_block_free(block_num+1)){
-            set_block_status(block_num, 1);
-            get_superblock()->inode_table_length++;
-        } else {
-            printf("Error: Block %d is not free, failed contiguous allocation of i-node table\n", block_num);
-            return;
+static int find_free_inode(uint32_t from, uint32_t end){
+    for(uint32_t i = from / 64; i * 64 < end; i++){
+        uint64_t free = ~inode_bitmap[i];
+
+        if(i == from / 64){
+            free &= ~0ULL << (from % 64);
+        }
+
+        if(free){
+            uint32_t inode_num = i * 64 + __builtin_ctzll(free);
+            return inode_num < end ? inode_num : -1;
         }
     }
 
-    uint32_t cache_index = get_oldest_inode();
-    for(int i = 0; i < INODE_CACHE_SIZE; i++){
-        if(inode_cache_index[i] == index){
-            cache_index = i;
+    return -1;
+}
+
+// First free i-node in the table blocks that lie in `group`, -1 if none
+static int find_free_group_inode(uint32_t group){
+    superblock_t *superblock = get_superblock();
+    uint32_t group_start = get_group_start(group);
+    uint32_t group_end = get_group_end(group);
+
+    for(uint32_t i = 0; i < superblock->inode_table_length;){
+        extent_t extent;
+        if(!find_extent(&superblock->inode_table_map, i, &extent)){
             break;
         }
+
+        // Part of the extent inside the group
+        uint32_t first = extent.physical > group_start ? extent.physical : group_start;
+        uint32_t last = extent.physical + extent.length < group_end ? extent.physical + extent.length : group_end;
+        if(first < last){
+            uint32_t from = (extent.logical + first - extent.physical) * INODES_PER_BLOCK;
+            int inode_num = find_free_inode(from, (extent.logical + last - extent.physical) * INODES_PER_BLOCK);
+            if(inode_num != -1){
+                return inode_num;
+            }
+        }
+
+        i = extent.logical + extent.length;
     }
+
+    return -1;
+}
+
+// Claims a free i-node in the table blocks of the next group in turn, so
+// that files and their data are spread over the groups. The table grows
+// into that group while it has room, otherwise any free i-node is taken
+// starting at the persistent hint
+uint32_t alloc_inode(){
+    superblock_t *superblock = get_superblock();
+
+    pthread_mutex_lock(&inode_cache_lock);
+    uint32_t table_inodes = superblock->inode_table_length * INODES_PER_BLOCK;
+    uint32_t group = next_inode_group++ % NUM_GROUPS;
+
+    int inode_num = find_free_group_inode(group);
+    if(inode_num == -1 && table_inodes < MAX_INODES && get_group_free_count(group) >= INODE_TABLE_CHUNK
+        && !grow_inode_table(group)){
+        inode_num = find_free_group_inode(group);
+        table_inodes = superblock->inode_table_length * INODES_PER_BLOCK;
+    }
+
+    if(inode_num == -1){
+        inode_num = find_free_inode(superblock->free_inode_hint, table_inodes);
+    }
+    if(inode_num == -1){
+        inode_num = find_free_inode(0, superblock->free_inode_hint);
+    }
+
+    if(inode_num == -1){
+        if(table_inodes >= MAX_INODES || grow_inode_table(group)){
+            pthread_mutex_unlock(&inode_cache_lock);
+            printf("Error: No free i-nodes\n");
+            return -1;
+        }
+        inode_num = table_inodes;
+    }
+
+    inode_bitmap[inode_num / 64] |= 1ULL << (inode_num % 64);
+    superblock->free_inode_count--;
+    superblock->free_inode_hint = inode_num + 1;
+    pthread_mutex_unlock(&inode_cache_lock);
+
+    return inode_num;
+}
+
+void release_inode(uint32_t inode_num){
+    superblock_t *superblock = get_superblock();
+
+    pthread_mutex_lock(&inode_cache_lock);
+    inode_bitmap[inode_num / 64] &= ~(1ULL << (inode_num % 64));
+    superblock->free_inode_count++;
+
+    if(inode_num < superblock->free_inode_hint){
+        superblock->free_inode_hint = inode_num;
+    }
+    pthread_mutex_unlock(&inode_cache_lock);
+}
+
+void write_inode(inode_t* node, uint32_t index){
+    pthread_mutex_lock(&inode_cache_lock);
+
+    int cache_index = find_cached_inode(index);
+    if(cache_index == -1){
+        cache_index = get_oldest_inode();
+        hash_cached_inode(cache_index, index);
+    }
+
     memcpy(&inode_cache[cache_index], node, sizeof(inode_t));
-    inode_cache_index[cache_index] = index;
+    inode_cache_dirty[cache_index] = 1;
     inode_cache_age[cache_index] = inode_rolling_counter;
 
     inode_rolling_counter++;
+    pthread_mutex_unlock(&inode_cache_lock);
+}
+
+// Also guards the i-node fields of the superblock, taken before the block cache
+void lock_inode_cache(){
+    pthread_mutex_lock(&inode_cache_lock);
+}
+
+void unlock_inode_cache(){
+    pthread_mutex_unlock(&inode_cache_lock);
+}
+
+// Free i-nodes in the table plus those it can still grow to hold, up to
+// MAX_INODES and as far as the free blocks allow
+uint32_t get_free_inode_count(){
+    superblock_t *superblock = get_superblock();
+
+    pthread_mutex_lock(&inode_cache_lock);
+    uint32_t count = superblock->free_inode_count;
+    uint32_t table_inodes = superblock->inode_table_length * INODES_PER_BLOCK;
+    pthread_mutex_unlock(&inode_cache_lock);
+
+    uint32_t unavailable = get_reserved_block_count() + EXTENT_RESERVE_BLOCKS;
+    uint32_t free_count = get_free_block_count();
+    uint32_t growth = free_count > unavailable ? (free_count - unavailable) * INODES_PER_BLOCK : 0;
+    if(growth > MAX_INODES - table_inodes){
+        growth = MAX_INODES - table_inodes;
+    }
+
+    return count + growth;
 }
 
 void flush_inode_cache(){
+    pthread_mutex_lock(&inode_cache_lock);
     for(int i = 0; i < INODE_CACHE_SIZE; i++){
-        if(inode_cache_index[i] != -1){
-            write_inode_to_disk(inode_cache_index[i], &inode_cache[i]);
+        if(inode_cache_dirty[i]){
+            write_back_inode_block(inode_cache_index[i] / INODES_PER_BLOCK);
+        }
+    }
+    pthread_mutex_unlock(&inode_cache_lock);
+}
+
+// A file's blocks go to the group holding its i-node. The table grows into
+// each group in turn, so files are spread over the groups a chunk at a time
+uint32_t get_inode_goal(uint32_t inode_index){
+    pthread_mutex_lock(&inode_cache_lock);
+    uint32_t block_num = get_inode_table_block(inode_index / INODES_PER_BLOCK);
+    pthread_mutex_unlock(&inode_cache_lock);
+
+    return get_group_goal(block_num == -1 ? 0 : block_num / BLOCKS_PER_GROUP);
+}
+
+uint32_t get_block_pointer(uint32_t inode_index, inode_t* node, uint32_t block_num){
+    if(node->flags & INODE_INLINE){
+        return -1;
+    }
+
+    // Most lookups are for the same file as the last one
+    if(map_cursor[map_cursor_last].inode != inode_index){
+        int slot = -1;
+        for(int i = 0; i < MAX_OPEN_FILES; i++){
+            if(map_cursor[i].inode == inode_index){
+                slot = i;
+                break;
+            }
+        }
+
+        // Cursors are taken over in turn
+        if(slot == -1){
+            slot = map_cursor_victim;
+            map_cursor_victim = (map_cursor_victim + 1) % MAX_OPEN_FILES;
+            map_cursor[slot].inode = -1;
+        }
+        map_cursor_last = slot;
+    }
+
+    map_cursor_t *cursor = &map_cursor[map_cursor_last];
+
+    if(cursor->inode != inode_index || cursor->generation != get_extent_generation()
+        || block_num < cursor->extent.logical || block_num - cursor->extent.logical >= cursor->extent.length){
+        cursor->mapped = find_extent(&node->map, block_num, &cursor->extent);
+        cursor->inode = inode_index;
+        cursor->generation = get_extent_generation();
+    }
+
+    if(!cursor->mapped){
+        return -1;
+    }
+
+    return cursor->extent.physical + (block_num - cursor->extent.logical);
+}
+
+// Delayed allocation. The counters change under the pool lock but are
+// also read without it by the fast paths and free space checks
+static void count_delalloc_blocks(int change){
+    __atomic_add_fetch(&delalloc_count, change, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&reserved_block_count, change, __ATOMIC_RELAXED);
+}
+
+static int get_delalloc_count(){
+    return __atomic_load_n(&delalloc_count, __ATOMIC_RELAXED);
+}
+
+static int find_tree_reserve(uint32_t inode_index){
+    for(int i = 0; i < DELALLOC_MAX_BLOCKS; i++){
+        if(tree_reserve[i].inode == inode_index){
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Tree blocks a write must find free on top of its data blocks, none once
+// the file already holds its reserve
+static uint32_t get_tree_blocks_needed(uint32_t inode_index, inode_t* node){
+    pthread_mutex_lock(&delalloc_lock);
+    int held = find_tree_reserve(inode_index) != -1;
+    pthread_mutex_unlock(&delalloc_lock);
+
+    return held ? 0 : get_extent_reserve(&node->map);
+}
+
+// Called with the pool locked
+static void reserve_tree_blocks(uint32_t inode_index, inode_t* node){
+    if(find_tree_reserve(inode_index) != -1){
+        return;
+    }
+
+    int slot = find_tree_reserve(-1);
+    tree_reserve[slot].inode = inode_index;
+    tree_reserve[slot].blocks = get_extent_reserve(&node->map);
+    tree_reserve[slot].failed = 0;
+    __atomic_add_fetch(&reserved_block_count, tree_reserve[slot].blocks, __ATOMIC_RELAXED);
+}
+
+// Called with the pool locked, gives the reserve back once the file has
+// no pending blocks left
+static void release_tree_blocks(uint32_t inode_index){
+    int slot = find_tree_reserve(inode_index);
+    if(slot == -1){
+        return;
+    }
+
+    for(int i = 0; i < DELALLOC_MAX_BLOCKS; i++){
+        if(delalloc_pool[i].inode == inode_index){
+            return;
+        }
+    }
+
+    __atomic_sub_fetch(&reserved_block_count, tree_reserve[slot].blocks, __ATOMIC_RELAXED);
+    tree_reserve[slot].inode = -1;
+}
+
+// -1 while the file has pending blocks that could not be written back
+int get_writeback_error(uint32_t inode_index){
+    pthread_mutex_lock(&delalloc_lock);
+    int slot = find_tree_reserve(inode_index);
+    int failed = slot != -1 && tree_reserve[slot].failed;
+    pthread_mutex_unlock(&delalloc_lock);
+
+    return failed ? -1 : 0;
+}
+
+// Pending blocks only change under their i-node's lock, so the returned
+// block stays valid while the caller holds it
+delalloc_block_t* get_delalloc_block(uint32_t inode_index, uint32_t block_num){
+    delalloc_block_t *found = NULL;
+
+    pthread_mutex_lock(&delalloc_lock);
+    for(int i = 0; i < DELALLOC_MAX_BLOCKS; i++){
+        if(delalloc_pool[i].inode == inode_index && delalloc_pool[i].block_num == block_num){
+            found = &delalloc_pool[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&delalloc_lock);
+
+    return found;
+}
+
+static int write_back_delalloc(uint32_t inode_index, inode_t* node, int wait);
+
+// Reserves a zero-filled block, writing the pool back first when it is full.
+// Files busy in other threads are skipped, so this waits for them to make
+// room only when nothing else can be written back. NULL when the pool
+// stays full because write back failed
+delalloc_block_t* new_delalloc_block(uint32_t inode_index, inode_t* node, uint32_t block_num){
+    pthread_mutex_lock(&delalloc_lock);
+
+    while(get_delalloc_count() == DELALLOC_MAX_BLOCKS){
+        int failed = write_back_delalloc(inode_index, node, 0);
+
+        if(get_delalloc_count() == DELALLOC_MAX_BLOCKS){
+            if(failed){
+                pthread_mutex_unlock(&delalloc_lock);
+                return NULL;
+            }
+
+            pthread_mutex_unlock(&delalloc_lock);
+            sched_yield();
+            pthread_mutex_lock(&delalloc_lock);
+        }
+    }
+
+    delalloc_block_t *pending = NULL;
+    for(int i = 0; i < DELALLOC_MAX_BLOCKS; i++){
+        if(delalloc_pool[i].inode == -1){
+            delalloc_pool[i].inode = inode_index;
+            delalloc_pool[i].block_num = block_num;
+            memset(delalloc_pool[i].block.data, 0, BLOCK_SIZE);
+
+            count_delalloc_blocks(1);
+            reserve_tree_blocks(inode_index, node);
+            pending = &delalloc_pool[i];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&delalloc_lock);
+    return pending;
+}
+
+// Drops the pending blocks of an i-node from logical block `from` on
+void drop_delalloc_blocks(uint32_t inode_index, uint32_t from){
+    pthread_mutex_lock(&delalloc_lock);
+    for(int i = 0; i < DELALLOC_MAX_BLOCKS; i++){
+        if(delalloc_pool[i].inode == inode_index && delalloc_pool[i].block_num >= from){
+            delalloc_pool[i].inode = -1;
+            count_delalloc_blocks(-1);
+        }
+    }
+    release_tree_blocks(inode_index);
+    pthread_mutex_unlock(&delalloc_lock);
+}
+
+uint32_t get_reserved_block_count(){
+    return __atomic_load_n(&reserved_block_count, __ATOMIC_RELAXED);
+}
+
+int compare_delalloc_blocks(const void* a, const void* b){
+    const delalloc_block_t *x = *(const delalloc_block_t**)a;
+    const delalloc_block_t *y = *(const delalloc_block_t**)b;
+
+    if(x->block_num != y->block_num){
+        return x->block_num < y->block_num ? -1 : 1;
+    }
+    return 0;
+}
+
+// Maps the pending blocks of one i-node, placing each run of consecutive
+// blocks in as few contiguous extents as possible
+int flush_delalloc_inode(uint32_t inode_index, inode_t* node){
+    delalloc_block_t *pending[DELALLOC_MAX_BLOCKS];
+    int pending_count = 0;
+
+    pthread_mutex_lock(&delalloc_lock);
+
+    for(int i = 0; i < DELALLOC_MAX_BLOCKS; i++){
+        if(delalloc_pool[i].inode == inode_index){
+            pending[pending_count++] = &delalloc_pool[i];
+        }
+    }
+
+    qsort(pending, pending_count, sizeof(delalloc_block_t*), compare_delalloc_blocks);
+
+    block_t *buffer = malloc(pending_count * sizeof(block_t));
+
+    for(int i = 0; i < pending_count;){
+        // Extent of consecutive logical blocks
+        int run_end = i + 1;
+        while(run_end < pending_count && pending[run_end]->block_num == pending[run_end - 1]->block_num + 1){
+            run_end++;
+        }
+
+        uint32_t goal = get_inode_goal(inode_index);
+        int extend = pending[i]->block_num > 0 && get_block_pointer(inode_index, node, pending[i]->block_num - 1) != -1;
+        if(extend){
+            goal = get_block_pointer(inode_index, node, pending[i]->block_num - 1) + 1;
+        }
+
+        while(i < run_end){
+            uint32_t run_length;
+            uint32_t run_start = alloc_block_run(goal, extend, run_end - i, &run_length);
+
+            extent_t extent = {pending[i]->block_num, run_start, run_length};
+            if(run_length == 0 || insert_extent(&node->map, &extent, get_inode_goal(inode_index))){
+                // Only possible once the extent tree outgrew its reserve. The
+                // rest stays pending, still readable, until space is freed
+                printf("Error: Failed to write back delayed blocks\n");
+                if(run_length > 0){
+                    set_block_run_status(run_start, run_length, 0);
+                }
+                int slot = find_tree_reserve(inode_index);
+                if(slot != -1){
+                    tree_reserve[slot].failed = 1;
+                }
+
+                free(buffer);
+                pthread_mutex_unlock(&delalloc_lock);
+                return -1;
+            }
+
+            for(uint32_t j = 0; j < run_length; j++){
+                memcpy(buffer[j].data, pending[i + j]->block.data, BLOCK_SIZE);
+
+                pending[i + j]->inode = -1;
+            }
+
+            drop_cached_blocks(run_start, run_length);
+            write_block_run(run_start, run_length, buffer);
+
+            count_delalloc_blocks(-(int)run_length);
+            goal = run_start + run_length;
+            extend = 1;
+            i += run_length;
+        }
+    }
+
+    free(buffer);
+    release_tree_blocks(inode_index);
+    pthread_mutex_unlock(&delalloc_lock);
+    return 0;
+}
+
+// Writes back every pending block, `node` is the caller's copy of i-node
+// `inode_index` (if any) and is updated in place. Other files are locked
+// first, those busy in other threads are skipped unless `wait` is set.
+// -1 when some file could not be written back
+static int write_back_delalloc(uint32_t inode_index, inode_t* node, int wait){
+    int failed = 0;
+
+    for(int i = 0; i < DELALLOC_MAX_BLOCKS; i++){
+        pthread_mutex_lock(&delalloc_lock);
+        uint32_t pending_inode = delalloc_pool[i].inode;
+        pthread_mutex_unlock(&delalloc_lock);
+
+        if(pending_inode == -1){
+            continue;
+        }
+
+        if(pending_inode == inode_index && node != NULL){
+            failed |= flush_delalloc_inode(pending_inode, node);
+            write_inode(node, pending_inode);
+            continue;
+        }
+
+        // The caller already holds the lock shared with its own i-node
+        int locked = node == NULL || pending_inode % INODE_LOCK_COUNT != inode_index % INODE_LOCK_COUNT;
+        if(locked){
+            if(wait){
+                lock_inode(pending_inode, 1);
+            } else if(try_lock_inode(pending_inode)){
+                continue;
+            }
+        }
+
+        inode_t pending_node;
+        get_inode(pending_inode, &pending_node);
+        failed |= flush_delalloc_inode(pending_inode, &pending_node);
+        write_inode(&pending_node, pending_inode);
+
+        if(locked){
+            unlock_inode(pending_inode);
         }
     }
+
+    return failed ? -1 : 0;
+}
+
+// Writes back every pending block, the caller holds no i-node lock.
+// -1 when some file could not be written back
+int flush_delalloc(){
+    return write_back_delalloc(-1, NULL, 1);
+}
+
+static byte_t* get_inline_data(inode_t* node){
+    return (byte_t*)&node->map;
+}
+
+// Moves the data of an inline i-node out to blocks once it outgrows the i-node
+static int convert_inline_inode(uint32_t inode_index, inode_t* node){
+    byte_t data[INODE_INLINE_SIZE];
+    uint32_t size = node->size;
+    memcpy(data, get_inline_data(node), INODE_INLINE_SIZE);
+
+    node->flags &= ~INODE_INLINE;
+    node->size = 0;
+    init_extent_root(&node->map);
+
+    if(size > 0 && write_to_inode(inode_index, node, 0, data, size) == -1){
+        memcpy(get_inline_data(node), data, INODE_INLINE_SIZE);
+        node->flags |= INODE_INLINE;
+        node->size = size;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Number of blocks from `block_num` on, at most `max_length`, that can be
+// read from disk in one request
+static uint32_t read_run_length(uint32_t inode_index, inode_t* node, uint32_t block_num, uint32_t max_length){
+    uint32_t start = get_block_pointer(inode_index, node, block_num);
+    if(start == -1){
+        return 0;
+    }
+
+    uint32_t length = 0;
+    while(length < max_length
+        && get_block_pointer(inode_index, node, block_num + length) == start + length
+        && !is_block_cached(start + length)
+        && (get_delalloc_count() == 0 || get_delalloc_block(inode_index, block_num + length) == NULL)){
+        length++;
+    }
+
+    return length;
 }
 
-int read_from_inode(inode_t* node, uint32_t offset, uint32_t size, void* buffer){
+int read_from_inode(uint32_t inode_index, inode_t* node, uint32_t offset, uint32_t size, void* buffer){
     uint32_t block_num = offset / BLOCK_SIZE;
     uint32_t block_offset = offset % BLOCK_SIZE;
 
+    if(offset >= node->size){
+        return 0;
+    }
+
+    if(node->flags & INODE_INLINE){
+        uint32_t bytes_read = node->size - offset < size ? node->size - offset : size;
+        memcpy(buffer, get_inline_data(node) + offset, bytes_read);
+        return bytes_read;
+    }
+
     uint32_t bytes_read = 0;
     uint32_t real_size = node->size - offset;
     while(bytes_read < size && real_size > 0){
+        block_t block;
 
-        uint32_t block_index;
-        if(block_num < INODE_DIRECT_ACCESS){
-            block_index = node->direct[block_num];
-        }else{
-            block_t indirect;
-            _read_block(node->indirect, &indirect);
+        // Whole blocks that are contiguous on disk and not cached are read
+        // straight into the caller's buffer with a single request
+        uint32_t whole_blocks = (size - bytes_read < real_size ? size - bytes_read : real_size) / BLOCK_SIZE;
+        if(block_offset == 0 && whole_blocks > 1){
+            uint32_t run_length = read_run_length(inode_index, node, block_num, whole_blocks);
+            if(run_length > 0){
+                read_block_run(get_block_pointer(inode_index, node, block_num), run_length, (byte_t *) buffer + bytes_read);
 
-            memcpy(&block_index, indirect.data + (block_num - INODE_DIRECT_ACCESS) * sizeof(uint32_t), sizeof(uint32_t));
+                bytes_read += run_length * BLOCK_SIZE;
+                real_size -= run_length * BLOCK_SIZE;
+                block_num += run_length;
+                continue;
+            }
         }
 
-        block_t block;
-        _read_block(block_index, &block);
+        // Pending blocks have no disk address yet, unmapped ones read as zeros
+        delalloc_block_t *pending = get_delalloc_block(inode_index, block_num);
+        if(pending != NULL){
+            memcpy(block.data, pending->block.data, BLOCK_SIZE);
+        } else {
+            uint32_t block_index = get_block_pointer(inode_index, node, block_num);
+            if(block_index == -1){
+                memset(block.data, 0, BLOCK_SIZE);
+            } else {
+                _read_block(block_index, &block);
+            }
+        }
 
         uint32_t bytes_to_read = BLOCK_SIZE - block_offset;
         if(bytes_to_read > size - bytes_read){
@@ -191,129 +909,538 @@ int read_from_inode(inode_t* node, uint32_t offset, uint32_t size, void* buffer)
     return bytes_read;
 }
 
-int write_to_inode(uint32_t inode_index, inode_t* node, uint32_t offset, byte_t* data, uint32_t length){
-    uint32_t block_num = offset / BLOCK_SIZE;
-    uint32_t block_offset = offset % BLOCK_SIZE;
+// Writes whole blocks from `block_num` on with one request per disk run.
+// Returns the number of blocks written, 0 when the first one is pending
+static int write_direct_run(uint32_t inode_index, inode_t* node, uint32_t block_num, byte_t* data, uint32_t max_length){
+    if(get_delalloc_count() > 0 && get_delalloc_block(inode_index, block_num) != NULL){
+        return 0;
+    }
 
-    // expand file if necessary
-    uint32_t new_size = offset + length;
-    if(new_size > node->size){
-        if((new_size) / BLOCK_SIZE >= INODE_MAX_BLOCKS){
-            printf("Error: Attempted to write past max file size\n");
+    uint32_t length = 0;
+    uint32_t start = get_block_pointer(inode_index, node, block_num);
+
+    // Mapped blocks are overwritten in place as far as they stay contiguous
+    if(start != -1){
+        while(length < max_length && get_block_pointer(inode_index, node, block_num + length) == start + length){
+            length++;
+        }
+
+        drop_cached_blocks(start, length);
+        write_block_run(start, length, data);
+        return length;
+    }
+
+    while(length < max_length && get_block_pointer(inode_index, node, block_num + length) == -1
+        && (get_delalloc_count() == 0 || get_delalloc_block(inode_index, block_num + length) == NULL)){
+        length++;
+    }
+
+    // Pending blocks before the run are placed first so that the run follows them
+    flush_delalloc_inode(inode_index, node);
+
+    uint32_t goal = get_inode_goal(inode_index);
+    int extend = block_num > 0 && get_block_pointer(inode_index, node, block_num - 1) != -1;
+    if(extend){
+        goal = get_block_pointer(inode_index, node, block_num - 1) + 1;
+    }
+
+    for(uint32_t i = 0; i < length;){
+        uint32_t run_length;
+        uint32_t run_start = alloc_block_run(goal, extend, length - i, &run_length);
+
+        extent_t extent = {block_num + i, run_start, run_length};
+        if(run_length == 0 || insert_extent(&node->map, &extent, get_inode_goal(inode_index))){
+            printf("Error: Failed to map blocks for a direct write\n");
+            if(run_length > 0){
+                set_block_run_status(run_start, run_length, 0);
+            }
             return -1;
         }
 
-        uint32_t current_block = node->size / BLOCK_SIZE;
+        drop_cached_blocks(run_start, run_length);
+        write_block_run(run_start, run_length, data + i * BLOCK_SIZE);
+
+        goal = run_start + run_length;
+        extend = 1;
+        i += run_length;
+    }
+
+    return length;
+}
+
+// Holes past the end of file read as zeros once the file grows over them,
+// preallocated blocks there hold stale data and are zeroed instead
+static void zero_preallocated_blocks(inode_t* node, uint32_t from, uint32_t to){
+    for(uint32_t i = from; i < to;){
+        extent_t extent;
+        if(!find_extent(&node->map, i, &extent)){
+            i = extent.length < to - i ? i + extent.length : to;
+            continue;
+        }
+
+        for(; i < extent.logical + extent.length && i < to; i++){
+            block_t block;
+            memset(block.data, 0, BLOCK_SIZE);
+            _write_block(extent.physical + (i - extent.logical), &block);
+        }
+    }
+}
+
+static int is_block_shared(uint32_t inode_index, inode_t* node, uint32_t block_num){
+    uint32_t block_index = get_block_pointer(inode_index, node, block_num);
+    return block_index != -1 && get_block_shares(block_index) > 0;
+}
+
+// Shared blocks are never written in place. Those overlapping [offset,
+// offset + length) are unmapped, and the ones only partly covered keep
+// their contents in a pending block that the write then goes to
+static int unshare_blocks(uint32_t inode_index, inode_t* node, uint32_t offset, uint32_t length){
+    uint32_t first_block = offset / BLOCK_SIZE;
+    uint32_t end_block = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    for(uint32_t i = first_block; i < end_block;){
+        if(!is_block_shared(inode_index, node, i)){
+            i++;
+            continue;
+        }
+
+        int partial = (i == first_block && offset % BLOCK_SIZE != 0)
+            || (i == end_block - 1 && (offset + length) % BLOCK_SIZE != 0);
 
-        if(current_block < INODE_DIRECT_ACCESS){
-            if(node->direct[current_block] != -1){
-                current_block++;
+        if(partial){
+            uint32_t blocks_needed = 1 + get_tree_blocks_needed(inode_index, node);
+            if(blocks_needed + get_reserved_block_count() + EXTENT_RESERVE_BLOCKS > get_free_block_count()){
+                printf("Error: Not enough free blocks\n");
+                return -1;
             }
-        }else{
-            if(node->indirect != -1){
-                block_t indirect;
-                _read_block(node->indirect, &indirect);
-                
-                uint32_t indirect_block;
-                memcpy(&indirect_block, indirect.data + (current_block - INODE_DIRECT_ACCESS) * sizeof(uint32_t), sizeof(uint32_t));
-
-                if(indirect_block != -1){
-                    current_block++;
-                }
+
+            block_t block;
+            _read_block(get_block_pointer(inode_index, node, i), &block);
+
+            if(punch_extents(&node->map, i, 1, get_inode_goal(inode_index))){
+                return -1;
+            }
+
+            delalloc_block_t *pending = new_delalloc_block(inode_index, node, i);
+            if(pending == NULL){
+                printf("Error: Failed to copy a shared block\n");
+                return -1;
             }
+            memcpy(pending->block.data, block.data, BLOCK_SIZE);
+
+            i++;
+            continue;
         }
 
-        for(int i = current_block; i < new_size / BLOCK_SIZE + 1; i++){
-            uint32_t block_index = get_next_free_block();
-            set_block_status(block_index, 1);
+        // Blocks written whole need no copy of their old contents
+        uint32_t start = get_block_pointer(inode_index, node, i);
+        uint32_t run_length = 1;
+        while(i + run_length < end_block && get_block_pointer(inode_index, node, i + run_length) == start + run_length
+            && get_block_shares(start + run_length) > 0
+            && !(i + run_length == end_block - 1 && (offset + length) % BLOCK_SIZE != 0)){
+            run_length++;
+        }
 
-            if(i < INODE_DIRECT_ACCESS){
-                node->direct[i] = block_index;
-            }else{
-                if(node->indirect == -1){
-                    node->indirect = get_next_free_block();
-                    set_block_status(node->indirect, 1);
-                }
+        if(punch_extents(&node->map, i, run_length, get_inode_goal(inode_index))){
+            return -1;
+        }
 
-                block_t block;
-                _read_block(node->indirect, &block);
+        i += run_length;
+    }
 
-                memcpy(block.data + (i - INODE_DIRECT_ACCESS) * sizeof(uint32_t), &block_index, sizeof(uint32_t));
+    return 0;
+}
 
-                _write_block(node->indirect, &block);
+int write_to_inode(uint32_t inode_index, inode_t* node, uint32_t offset, byte_t* data, uint32_t length){
+    uint32_t block_num = offset / BLOCK_SIZE;
+    uint32_t block_offset = offset % BLOCK_SIZE;
+
+    if(offset > INODE_MAX_SIZE || length > INODE_MAX_SIZE - offset){
+        printf("Error: Attempted to write past max file size\n");
+        return -1;
+    }
+
+    // Bytes past the end of an inline file are kept zeroed, so a gap needs no fill
+    if(node->flags & INODE_INLINE){
+        if(offset + length <= INODE_INLINE_SIZE){
+            memcpy(get_inline_data(node) + offset, data, length);
+            if(offset + length > node->size){
+                node->size = offset + length;
             }
 
-            
+            write_inode(node, inode_index);
+            return length;
         }
 
+        if(convert_inline_inode(inode_index, node)){
+            return -1;
+        }
+    }
 
-        node->size = new_size;
+    uint32_t old_size = node->size;
+    uint32_t new_size = offset + length;
+    uint32_t block_count = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // Unmapped blocks only get a disk address on write back, reserve space
+    // for them now so that the write fails up front when the disk is full.
+    // Shared blocks are copied and need as much
+    uint32_t blocks_needed = 0;
+    for(uint32_t i = block_num; i < block_count; i++){
+        uint32_t block_index = get_block_pointer(inode_index, node, i);
+        if(block_index == -1 ? get_delalloc_block(inode_index, i) == NULL : get_block_shares(block_index) > 0){
+            blocks_needed++;
+        }
     }
 
-    write_inode(node, inode_index);
+    // The file keeps tree blocks back for mapping its pending blocks, the
+    // last few blocks are kept for the other trees to grow
+    if(blocks_needed > 0){
+        blocks_needed += get_tree_blocks_needed(inode_index, node);
+    }
+    if(blocks_needed > 0 && blocks_needed + get_reserved_block_count() + EXTENT_RESERVE_BLOCKS > get_free_block_count()){
+        printf("Error: Not enough free blocks\n");
+        return -1;
+    }
+
+    if(unshare_blocks(inode_index, node, offset, length)){
+        write_inode(node, inode_index);
+        return -1;
+    }
+
+    // Blocks between the end of file and the write stay unmapped holes
+    zero_preallocated_blocks(node, (old_size + BLOCK_SIZE - 1) / BLOCK_SIZE, block_num);
+
+    if(new_size > node->size){
+        node->size = new_size;
+    }
 
     uint32_t bytes_written = 0;
     while(bytes_written < length){
-        uint32_t block_index;
-        if(block_num < INODE_DIRECT_ACCESS){
-            block_index = node->direct[block_num];
-        }else{
-            block_t block;
-            _read_block(node->indirect, &block);
+        // Large aligned stretches bypass the cache and the delayed allocation pool
+        uint32_t whole_blocks = (length - bytes_written) / BLOCK_SIZE;
+        if(block_offset == 0 && whole_blocks >= DIRECT_WRITE_MIN_BLOCKS){
+            int run_length = write_direct_run(inode_index, node, block_num, data + bytes_written, whole_blocks);
+            if(run_length == -1){
+                write_inode(node, inode_index);
+                return -1;
+            }
 
-            memcpy(&block_index, block.data + (block_num - INODE_DIRECT_ACCESS) * sizeof(uint32_t), sizeof(uint32_t));
+            if(run_length > 0){
+                bytes_written += run_length * BLOCK_SIZE;
+                block_num += run_length;
+                continue;
+            }
         }
 
-        block_t block;
-        _read_block(block_index, &block);
-
         uint32_t bytes_to_write = BLOCK_SIZE - block_offset;
         if(bytes_to_write > length - bytes_written){
             bytes_to_write = length - bytes_written;
         }
 
-        memcpy(block.data + block_offset, data + bytes_written, bytes_to_write);
+        delalloc_block_t *pending = get_delalloc_block(inode_index, block_num);
+        uint32_t block_index = get_block_pointer(inode_index, node, block_num);
 
-        _write_block(block_index, &block);
+        if(pending == NULL && block_index == -1){
+            pending = new_delalloc_block(inode_index, node, block_num);
+            if(pending == NULL){
+                printf("Error: Not enough free blocks\n");
+                write_inode(node, inode_index);
+                return -1;
+            }
+        }
+
+        if(pending != NULL){
+            memcpy(pending->block.data + block_offset, data + bytes_written, bytes_to_write);
+        } else {
+            // Preallocated blocks past the end of file hold no data yet
+            block_t block;
+            if(block_num * BLOCK_SIZE >= old_size){
+                memset(block.data, 0, BLOCK_SIZE);
+            } else {
+                _read_block(block_index, &block);
+            }
+
+            memcpy(block.data + block_offset, data + bytes_written, bytes_to_write);
+
+            _write_block(block_index, &block);
+        }
 
         bytes_written += bytes_to_write;
         block_num++;
         block_offset = 0;
     }
 
+    write_inode(node, inode_index);
+
     return bytes_written;
 }
 
-void remove_inode(uint32_t index){
-    inode_t node;
-    get_inode(index, &node);
+// Offset of the first byte at or after `offset` that is data, or that is a
+// hole when `data` is 0. The end of file counts as a hole, -1 past it
+int seek_inode(uint32_t inode_index, inode_t* node, uint32_t offset, int data){
+    if(offset >= node->size){
+        return -1;
+    }
 
-    node.size = 0;
-    node.link_count--;
+    if(node->flags & INODE_INLINE){
+        return data ? offset : node->size;
+    }
 
-    if(node.link_count <=0){
-        for(int i = 0; i < INODE_DIRECT_ACCESS; i++){
-            if(node.direct[i] != -1){
-                set_block_status(node.direct[i], 0);
-                node.direct[i] = -1;
-            }
+    uint32_t block_count = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for(uint32_t i = offset / BLOCK_SIZE; i < block_count;){
+        extent_t extent;
+        int is_data = find_extent(&node->map, i, &extent);
+        uint32_t next = extent.length < block_count - i ? i + extent.length : block_count;
+        if(is_data){
+            next = extent.logical + extent.length;
         }
 
-        if(node.indirect != -1){
-            block_t indirect;
-            _read_block(node.indirect, &indirect);
+        // Pending blocks are data that is not mapped yet
+        if(!is_data && get_delalloc_count() > 0){
+            is_data = get_delalloc_block(inode_index, i) != NULL;
+            next = i + 1;
+        }
 
-            for(int i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++){
-                uint32_t block_index;
-                memcpy(&block_index, indirect.data + i * sizeof(uint32_t), sizeof(uint32_t));
+        if(is_data == (data != 0)){
+            return i * BLOCK_SIZE > offset ? i * BLOCK_SIZE : offset;
+        }
 
-                if(block_index != -1){
-                    set_block_status(block_index, 0);
+        i = next;
+    }
+
+    return data ? -1 : node->size;
+}
+
+// Maps disk blocks for [offset, offset + length) without writing data or
+// changing the file size, in as few contiguous runs as possible
+int preallocate_inode(uint32_t inode_index, inode_t* node, uint32_t offset, uint32_t length){
+    if(offset > INODE_MAX_SIZE || length > INODE_MAX_SIZE - offset){
+        printf("Error: Attempted to preallocate past max file size\n");
+        return -1;
+    }
+
+    if(node->flags & INODE_INLINE && convert_inline_inode(inode_index, node)){
+        return -1;
+    }
+
+    uint32_t first_block = offset / BLOCK_SIZE;
+    uint32_t block_count = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // Pending blocks get their disk address first, holes left under them
+    // would be mapped twice
+    if(flush_delalloc_inode(inode_index, node)){
+        write_inode(node, inode_index);
+        return -1;
+    }
+
+    uint32_t blocks_needed = 0;
+    for(uint32_t i = first_block; i < block_count;){
+        extent_t extent;
+        if(!find_extent(&node->map, i, &extent)){
+            blocks_needed += extent.length < block_count - i ? extent.length : block_count - i;
+        }
+        i += extent.length - (i - extent.logical);
+    }
+
+    // The inserts below may grow the extent tree
+    if(blocks_needed > 0){
+        blocks_needed += get_extent_reserve(&node->map);
+    }
+    if(blocks_needed > 0 && blocks_needed + get_reserved_block_count() + EXTENT_RESERVE_BLOCKS > get_free_block_count()){
+        printf("Error: Not enough free blocks\n");
+        return -1;
+    }
+
+    uint32_t goal = get_inode_goal(inode_index);
+    int extend = first_block > 0 && get_block_pointer(inode_index, node, first_block - 1) != -1;
+    if(extend){
+        goal = get_block_pointer(inode_index, node, first_block - 1) + 1;
+    }
+
+    for(uint32_t i = first_block; i < block_count;){
+        extent_t extent;
+        if(find_extent(&node->map, i, &extent)){
+            goal = extent.physical + extent.length;
+            extend = 1;
+            i = extent.logical + extent.length;
+            continue;
+        }
+
+        // Hole up to the next extent
+        uint32_t run_end = extent.length < block_count - i ? i + extent.length : block_count;
+
+        while(i < run_end){
+            uint32_t run_length;
+            uint32_t run_start = alloc_block_run(goal, extend, run_end - i, &run_length);
+
+            extent_t run = {i, run_start, run_length};
+            if(run_length == 0 || insert_extent(&node->map, &run, get_inode_goal(inode_index))){
+                if(run_length > 0){
+                    set_block_run_status(run_start, run_length, 0);
                 }
+                write_inode(node, inode_index);
+                return -1;
+            }
+
+            drop_cached_blocks(run_start, run_length);
+
+            // Holes below the end of file must keep reading as zeros
+            uint32_t size_blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if(i < size_blocks){
+                uint32_t zero_length = size_blocks - i < run_length ? size_blocks - i : run_length;
+                block_t *zeros = calloc(zero_length, sizeof(block_t));
+                write_block_run(run_start, zero_length, zeros);
+                free(zeros);
+            }
+
+            goal = run_start + run_length;
+            extend = 1;
+            i += run_length;
+        }
+    }
+
+    write_inode(node, inode_index);
+
+    return 0;
+}
+
+// Sets the size of a file. Shrinking frees every block past the new end in
+// one batch and zeroes the rest of the new last block, growing leaves a hole
+int truncate_inode(uint32_t inode_index, inode_t* node, uint32_t size){
+    if(size > INODE_MAX_SIZE){
+        printf("Error: Attempted to truncate past max file size\n");
+        return -1;
+    }
+
+    if(node->flags & INODE_INLINE){
+        if(size <= INODE_INLINE_SIZE){
+            if(size < node->size){
+                memset(get_inline_data(node) + size, 0, node->size - size);
+            }
+
+            node->size = size;
+            write_inode(node, inode_index);
+            return 0;
+        }
+
+        if(convert_inline_inode(inode_index, node)){
+            return -1;
+        }
+    }
+
+    uint32_t block_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if(size < node->size){
+        // The new last block is zeroed past the end below, never in place if shared
+        if(size % BLOCK_SIZE != 0 && unshare_blocks(inode_index, node, size, 1)){
+            write_inode(node, inode_index);
+            return -1;
+        }
+
+        drop_delalloc_blocks(inode_index, block_count);
+        truncate_extents(&node->map, block_count);
+
+        // Bytes past the end of file must read as zeros if it grows again
+        if(size % BLOCK_SIZE != 0){
+            uint32_t tail = size % BLOCK_SIZE;
+            delalloc_block_t *pending = get_delalloc_block(inode_index, size / BLOCK_SIZE);
+            uint32_t block_index = get_block_pointer(inode_index, node, size / BLOCK_SIZE);
+
+            if(pending != NULL){
+                memset(pending->block.data + tail, 0, BLOCK_SIZE - tail);
+            } else if(block_index != -1){
+                block_t block;
+                _read_block(block_index, &block);
+                memset(block.data + tail, 0, BLOCK_SIZE - tail);
+                _write_block(block_index, &block);
             }
+        }
+    } else {
+        zero_preallocated_blocks(node, (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE, block_count);
+    }
+
+    node->size = size;
+    write_inode(node, inode_index);
+
+    return 0;
+}
+
+// Makes `copy` share every block of `node` below its end of file, a block
+// is only copied once one of the files writes to it
+int clone_inode(uint32_t inode_index, inode_t* node, uint32_t copy_index, inode_t* copy){
+    copy->size = node->size;
+    copy->flags = node->flags;
+
+    if(node->flags & INODE_INLINE){
+        copy->map = node->map;
+        write_inode(copy, copy_index);
+        return 0;
+    }
+
+    // Pending blocks need a disk address before they can be shared
+    int failed = flush_delalloc_inode(inode_index, node);
+    write_inode(node, inode_index);
+    if(failed){
+        return -1;
+    }
+
+    init_extent_root(&copy->map);
+
+    // Preallocated blocks past the end of file stay with the source
+    uint32_t block_count = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for(uint32_t i = 0; i < block_count;){
+        extent_t extent;
+        if(!find_extent(&node->map, i, &extent)){
+            i = extent.length < block_count - i ? i + extent.length : block_count;
+            continue;
+        }
+
+        extent_t shared = {i, extent.physical + (i - extent.logical), extent.logical + extent.length - i};
+        if(shared.length > block_count - i){
+            shared.length = block_count - i;
+        }
+
+        // Unmapping the copy drops the users added so far
+        if(share_block_run(shared.physical, shared.length)){
+            truncate_extents(&copy->map, 0);
+            return -1;
+        }
+
+        if(insert_extent(&copy->map, &shared, get_inode_goal(copy_index))){
+            // The run never got mapped, its users are dropped by hand
+            uint32_t *blocks = malloc(shared.length * sizeof(uint32_t));
+            for(uint32_t j = 0; j < shared.length; j++){
+                blocks[j] = shared.physical + j;
+            }
+            free_block_list(blocks, shared.length);
+            free(blocks);
+
+            truncate_extents(&copy->map, 0);
+            return -1;
+        }
+
+        i += shared.length;
+    }
+
+    write_inode(copy, copy_index);
+    return 0;
+}
+
+void remove_inode(uint32_t index){
+    inode_t node;
+    get_inode(index, &node);
+
+    drop_delalloc_blocks(index, 0);
+
+    node.size = 0;
+    node.link_count--;
+
+    if(node.link_count <=0){
+        release_inode(index);
 
-            set_block_status(node.indirect, 0);
-            node.indirect = -1;
+        // Every mapped block is released in one batch
+        if(!(node.flags & INODE_INLINE)){
+            truncate_extents(&node.map, 0);
         }
     }
 
@@ -10,9 +10,88 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+// FUSE runs requests in several threads and sfs_fopen hands out one
+// descriptor per file. It stays open from .open or .create until the last
+// .release, and after that until no request is using it
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fd_released = PTHREAD_COND_INITIALIZER;
+static int fd_opens[MAX_OPEN_FILES];
+static int fd_users[MAX_OPEN_FILES];
+
+// Bumped when unlink closes a descriptor, handles to it then go stale
+static uint32_t fd_generation[MAX_OPEN_FILES];
+
+static void close_unused_fd(int fd)
+{
+    if (fd_opens[fd] == 0 && fd_users[fd] == 0) {
+        sfs_fclose(fd);
+        pthread_cond_broadcast(&fd_released);
+    }
+}
+
+static int open_fd(char *filename, struct fuse_file_info *fi)
+{
+    int fd;
+    
+    pthread_mutex_lock(&fd_lock);
+    fd = sfs_fopen(filename);
+    if (fd != -1) {
+        fd_opens[fd]++;
+        fi->fh = (uint64_t)fd_generation[fd] << 32 | fd;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    
+    return fd;
+}
+
+// Marks the descriptor of an open handle as in use, errno is ENOENT when
+// the file was unlinked since
+static int acquire_fd(struct fuse_file_info *fi)
+{
+    int fd = fi->fh & 0xFFFFFFFF;
+    
+    pthread_mutex_lock(&fd_lock);
+    if (fi->fh >> 32 == fd_generation[fd]) {
+        fd_users[fd]++;
+    } else {
+        errno = ENOENT;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    
+    return fd;
+}
+
+// Same for a request that only has a path, without creating a missing file
+static int acquire_path_fd(char *filename)
+{
+    int fd = -1;
+    
+    pthread_mutex_lock(&fd_lock);
+    if (sfs_getfilesize(filename) != -1) {
+        fd = sfs_fopen(filename);
+        if (fd != -1)
+            fd_users[fd]++;
+    } else {
+        errno = ENOENT;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    
+    return fd;
+}
+
+static void release_fd(int fd)
+{
+    pthread_mutex_lock(&fd_lock);
+    fd_users[fd]--;
+    close_unused_fd(fd);
+    pthread_mutex_unlock(&fd_lock);
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
@@ -53,11 +132,29 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 static int fuse_unlink(const char *path)
 {
-    int res;
+    int fd, res;
     char filename[MAXFILENAME];
     
     strcpy(filename, path);
+    
+    // sfs_remove closes the file's descriptor, wait until no request uses it
+    pthread_mutex_lock(&fd_lock);
+    if (sfs_getfilesize(filename) == -1) {
+        pthread_mutex_unlock(&fd_lock);
+        return -ENOENT;
+    }
+    
+    while ((fd = sfs_fopen(filename)) != -1 && fd_users[fd] > 0)
+        pthread_cond_wait(&fd_released, &fd_lock);
+    
+    // Handles still open on the file go stale
+    if (fd != -1) {
+        fd_opens[fd] = 0;
+        fd_generation[fd]++;
+    }
+    
     res = sfs_remove(filename);
+    pthread_mutex_unlock(&fd_lock);
     if (res == -1)
         return -errno;
     
@@ -71,11 +168,24 @@ static int fuse_open(const char *path, struct fuse_file_info *fi)
     
     strcpy(filename, path);
     
-    res = sfs_fopen(filename);
+    res = open_fd(filename, fi);
     if (res == -1)
         return -errno;
     
-    sfs_fclose(res);
+    return 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    int fd = fi->fh & 0xFFFFFFFF;
+    
+    pthread_mutex_lock(&fd_lock);
+    if (fi->fh >> 32 == fd_generation[fd]) {
+        fd_opens[fd]--;
+        close_unused_fd(fd);
+    }
+    pthread_mutex_unlock(&fd_lock);
+    
     return 0;
 }
 
@@ -85,22 +195,15 @@ static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
     int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
+    fd = acquire_fd(fi);
     if (fd == -1)
         return -errno;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
+    res = sfs_fpread(fd, buf, size, offset);
+    release_fd(fd);
     if (res == -1)
         return -errno;
     
-    sfs_fclose(fd);
     return res;
 }
 
@@ -110,22 +213,15 @@ static int fuse_write(const char *path, const char *buf, size_t size,
     int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
+    fd = acquire_fd(fi);
     if (fd == -1) 
         return -errno;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fwrite(fd, buf, size);
+    res = sfs_fpwrite(fd, buf, size, offset);
+    release_fd(fd);
     if (res == -1)
         return -errno;
     
-    sfs_fclose(fd);
     return res;
 }
 
@@ -133,15 +229,19 @@ static int fuse_truncate(const char *path, off_t size)
 {
     char filename[MAXFILENAME];
     int fd;
+    int res;
     
     strcpy(filename, path);
     
-    fd = sfs_remove(filename);
+    fd = acquire_path_fd(filename);
     if (fd == -1)
         return -errno;
     
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
+    res = sfs_ftruncate(fd, size);
+    release_fd(fd);
+    if (res == -1)
+        return -errno;
+    
     return 0;
 }
 
@@ -161,9 +261,10 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     int fd;
     
     strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    fd = open_fd(filename, fp);
+    if (fd == -1)
+        return -errno;
     
-    sfs_fclose(fd);
     return 0;
 }
 
@@ -178,6 +279,7 @@ static struct fuse_operations xmp_oper = {
     .write = fuse_write, 
     .access = fuse_access,
     .create = fuse_create,
+    .release = fuse_release,
 };
 
 int main(int argc, char *argv[])